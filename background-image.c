@@ -1,37 +1,12 @@
 #include <assert.h>
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
 #include "background-image.h"
 #include "cairo.h"
 #include "log.h"
 #include "waylogout.h"
 
-// Cairo RGB24 uses 32 bits per pixel, as XRGB, in native endianness.
-// xrgb32_le uses 32 bits per pixel, as XRGB, little endian (BGRX big endian).
-void cairo_rgb24_from_xrgb32_le(unsigned char *buf, int width, int height, int stride) {
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			unsigned char *pix = buf + y * stride + x * 4;
-			*(uint32_t *)pix = 0 |
-				(uint32_t)pix[2] << 16 |
-				(uint32_t)pix[1] << 8 |
-				(uint32_t)pix[0];
-		}
-	}
-}
-
-// Cairo RGB24 uses 32 bits per pixel, as XRGB, in native endianness.
-// xbgr32_le uses 32 bits per pixel, as XBGR, little endian (RGBX big endian).
-void cairo_rgb24_from_xbgr32_le(unsigned char *buf, int width, int height, int stride) {
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			unsigned char *pix = buf + y * stride + x * 4;
-			*(uint32_t *)pix = 0 |
-				(uint32_t)pix[0] << 16 |
-				(uint32_t)pix[1] << 8 |
-				(uint32_t)pix[2];
-		}
-	}
-}
-
 enum background_mode parse_background_mode(const char *mode) {
 	if (strcmp(mode, "stretch") == 0) {
 		return BACKGROUND_MODE_STRETCH;
@@ -50,144 +25,442 @@ enum background_mode parse_background_mode(const char *mode) {
 	return BACKGROUND_MODE_INVALID;
 }
 
-cairo_surface_t *load_background_from_buffer(void *buf, uint32_t format,
-		uint32_t width, uint32_t height, uint32_t stride, enum wl_output_transform transform) {
-	bool rotated =
-		transform == WL_OUTPUT_TRANSFORM_90 ||
-		transform == WL_OUTPUT_TRANSFORM_270 ||
-		transform == WL_OUTPUT_TRANSFORM_FLIPPED_90 ||
-		transform == WL_OUTPUT_TRANSFORM_FLIPPED_270;
+// Screenshots come in whichever wl_shm format the compositor picks. Every
+// format we know has a function to turn a run of its pixels into cairo RGB24
+// pixels, which are XRGB in native endianness. wl_shm formats are all
+// little endian.
+struct shm_format {
+	uint32_t format;
+	int bytes; // per pixel
+	void (*convert)(uint32_t *dest, const uint8_t *src, int count);
+};
 
-	cairo_surface_t *image;
-	if (rotated) {
-		image = cairo_image_surface_create(CAIRO_FORMAT_RGB24, height, width);
-	} else {
-		image = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+static inline uint32_t load_le32(const uint8_t *p) {
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+		(uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint32_t load_le16(const uint8_t *p) {
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8;
+}
+
+static inline uint32_t rgb24_from_xbgr8888(uint32_t pix) {
+	return (pix & 0x00ff00) | (pix << 16 & 0xff0000) | (pix >> 16 & 0x0000ff);
+}
+
+// The 10-bit channels keep their top 8 bits
+static inline uint32_t rgb24_from_xrgb2101010(uint32_t pix) {
+	return (pix >> 6 & 0xff0000) | (pix >> 4 & 0x00ff00) | (pix >> 2 & 0x0000ff);
+}
+
+static inline uint32_t rgb24_from_xbgr2101010(uint32_t pix) {
+	return (pix << 14 & 0xff0000) | (pix >> 4 & 0x00ff00) | (pix >> 22 & 0x0000ff);
+}
+
+// The 5- and 6-bit channels are widened by repeating their top bits,
+// so that full intensity stays full intensity
+static inline uint32_t rgb24_from_rgb565(uint32_t pix) {
+	uint32_t r = pix >> 11 & 0x1f, g = pix >> 5 & 0x3f, b = pix & 0x1f;
+	return (r << 3 | r >> 2) << 16 | (g << 2 | g >> 4) << 8 | (b << 3 | b >> 2);
+}
+
+#if defined(USE_SSE) && defined(__SSE2__)
+#include <emmintrin.h>
+
+// The same conversions, four pixels at a time
+
+static inline __m128i rgb24_from_xbgr8888_sse2(__m128i pix) {
+	__m128i g = _mm_and_si128(pix, _mm_set1_epi32(0x00ff00));
+	__m128i r = _mm_and_si128(_mm_slli_epi32(pix, 16), _mm_set1_epi32(0xff0000));
+	__m128i b = _mm_and_si128(_mm_srli_epi32(pix, 16), _mm_set1_epi32(0x0000ff));
+	return _mm_or_si128(_mm_or_si128(r, g), b);
+}
+
+static inline __m128i rgb24_from_xrgb2101010_sse2(__m128i pix) {
+	__m128i r = _mm_and_si128(_mm_srli_epi32(pix, 6), _mm_set1_epi32(0xff0000));
+	__m128i g = _mm_and_si128(_mm_srli_epi32(pix, 4), _mm_set1_epi32(0x00ff00));
+	__m128i b = _mm_and_si128(_mm_srli_epi32(pix, 2), _mm_set1_epi32(0x0000ff));
+	return _mm_or_si128(_mm_or_si128(r, g), b);
+}
+
+static inline __m128i rgb24_from_xbgr2101010_sse2(__m128i pix) {
+	__m128i r = _mm_and_si128(_mm_slli_epi32(pix, 14), _mm_set1_epi32(0xff0000));
+	__m128i g = _mm_and_si128(_mm_srli_epi32(pix, 4), _mm_set1_epi32(0x00ff00));
+	__m128i b = _mm_and_si128(_mm_srli_epi32(pix, 22), _mm_set1_epi32(0x0000ff));
+	return _mm_or_si128(_mm_or_si128(r, g), b);
+}
+
+// Takes four 16-bit pixels, zero-extended to 32 bits
+static inline __m128i rgb24_from_rgb565_sse2(__m128i pix) {
+	__m128i r = _mm_and_si128(_mm_srli_epi32(pix, 11), _mm_set1_epi32(0x1f));
+	__m128i g = _mm_and_si128(_mm_srli_epi32(pix, 5), _mm_set1_epi32(0x3f));
+	__m128i b = _mm_and_si128(pix, _mm_set1_epi32(0x1f));
+	r = _mm_or_si128(_mm_slli_epi32(r, 3), _mm_srli_epi32(r, 2));
+	g = _mm_or_si128(_mm_slli_epi32(g, 2), _mm_srli_epi32(g, 4));
+	b = _mm_or_si128(_mm_slli_epi32(b, 3), _mm_srli_epi32(b, 2));
+	return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(r, 16), _mm_slli_epi32(g, 8)), b);
+}
+#endif
+
+// For pixels which are RGB24 already
+static void convert_native(uint32_t *dest, const uint8_t *src, int count) {
+	memcpy(dest, src, (size_t)count * 4);
+}
+
+static void convert_xrgb8888(uint32_t *dest, const uint8_t *src, int count) {
+	// If we're little endian, this already is RGB24
+	int test = 1;
+	if (*(char *)&test == 1) {
+		convert_native(dest, src, count);
+		return;
 	}
-	if (image == NULL) {
-		waylogout_log(LOG_ERROR, "Failed to create image..");
-		return NULL;
+
+	for (int x = 0; x < count; ++x) {
+		dest[x] = load_le32(src + x * 4);
 	}
+}
 
-	unsigned char *destbuf = cairo_image_surface_get_data(image);
-	size_t destwidth = cairo_image_surface_get_width(image);
-	size_t destheight = cairo_image_surface_get_height(image);
-	size_t deststride = cairo_image_surface_get_stride(image);
-	unsigned char *srcbuf = buf;
-	size_t srcstride = stride;
-	size_t minstride = srcstride < deststride ? srcstride : deststride;
-
-	// Lots of these are mostly-copy-and-pasted, with a lot of boilerplate
-	// for each case.
-	// The only interesting differencess between a lot of these cases are
-	// the definitions of srcx and srcy.
-	// I don't think it's worth adding a macro to make this "cleaner" though,
-	// as that would obfuscate what's actually going on.
-	switch (transform) {
-	case WL_OUTPUT_TRANSFORM_NORMAL:
-		// In most cases, the transform is probably normal. Luckily, it can be
-		// done with just one big memcpy.
-		if (srcstride == deststride) {
-			memcpy(destbuf, srcbuf, destheight * deststride);
-		} else {
-			for (size_t y = 0; y < destheight; ++y) {
-				memcpy(destbuf + y * deststride, srcbuf + y * srcstride, minstride);
+static void convert_xbgr8888(uint32_t *dest, const uint8_t *src, int count) {
+	int x = 0;
+#if defined(USE_SSE) && defined(__SSE2__)
+	for (; x + 4 <= count; x += 4) {
+		__m128i pix = _mm_loadu_si128((const __m128i *)(src + x * 4));
+		_mm_storeu_si128((__m128i *)(dest + x), rgb24_from_xbgr8888_sse2(pix));
+	}
+#endif
+	for (; x < count; ++x) {
+		dest[x] = rgb24_from_xbgr8888(load_le32(src + x * 4));
+	}
+}
+
+static void convert_xrgb2101010(uint32_t *dest, const uint8_t *src, int count) {
+	int x = 0;
+#if defined(USE_SSE) && defined(__SSE2__)
+	for (; x + 4 <= count; x += 4) {
+		__m128i pix = _mm_loadu_si128((const __m128i *)(src + x * 4));
+		_mm_storeu_si128((__m128i *)(dest + x), rgb24_from_xrgb2101010_sse2(pix));
+	}
+#endif
+	for (; x < count; ++x) {
+		dest[x] = rgb24_from_xrgb2101010(load_le32(src + x * 4));
+	}
+}
+
+static void convert_xbgr2101010(uint32_t *dest, const uint8_t *src, int count) {
+	int x = 0;
+#if defined(USE_SSE) && defined(__SSE2__)
+	for (; x + 4 <= count; x += 4) {
+		__m128i pix = _mm_loadu_si128((const __m128i *)(src + x * 4));
+		_mm_storeu_si128((__m128i *)(dest + x), rgb24_from_xbgr2101010_sse2(pix));
+	}
+#endif
+	for (; x < count; ++x) {
+		dest[x] = rgb24_from_xbgr2101010(load_le32(src + x * 4));
+	}
+}
+
+static void convert_rgb565(uint32_t *dest, const uint8_t *src, int count) {
+	int x = 0;
+#if defined(USE_SSE) && defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128();
+	for (; x + 8 <= count; x += 8) {
+		__m128i pix = _mm_loadu_si128((const __m128i *)(src + x * 2));
+		_mm_storeu_si128((__m128i *)(dest + x),
+				rgb24_from_rgb565_sse2(_mm_unpacklo_epi16(pix, zero)));
+		_mm_storeu_si128((__m128i *)(dest + x + 4),
+				rgb24_from_rgb565_sse2(_mm_unpackhi_epi16(pix, zero)));
+	}
+#endif
+	for (; x < count; ++x) {
+		dest[x] = rgb24_from_rgb565(load_le16(src + x * 2));
+	}
+}
+
+// Alpha is ignored, so every format shares its converter with its X twin
+static const struct shm_format shm_formats[] = {
+	{ WL_SHM_FORMAT_XRGB8888, 4, convert_xrgb8888 },
+	{ WL_SHM_FORMAT_ARGB8888, 4, convert_xrgb8888 },
+	{ WL_SHM_FORMAT_XBGR8888, 4, convert_xbgr8888 },
+	{ WL_SHM_FORMAT_ABGR8888, 4, convert_xbgr8888 },
+	{ WL_SHM_FORMAT_XRGB2101010, 4, convert_xrgb2101010 },
+	{ WL_SHM_FORMAT_ARGB2101010, 4, convert_xrgb2101010 },
+	{ WL_SHM_FORMAT_XBGR2101010, 4, convert_xbgr2101010 },
+	{ WL_SHM_FORMAT_ABGR2101010, 4, convert_xbgr2101010 },
+	{ WL_SHM_FORMAT_RGB565, 2, convert_rgb565 },
+};
+
+static const struct shm_format *shm_format_get(uint32_t format) {
+	for (size_t i = 0; i < sizeof(shm_formats) / sizeof(*shm_formats); ++i) {
+		if (shm_formats[i].format == format) {
+			return &shm_formats[i];
+		}
+	}
+
+	waylogout_log(LOG_ERROR,
+			"Unknown pixel format: %u. Assuming XRGB32. Colors may look wrong.",
+			format);
+	return &shm_formats[0];
+}
+
+// Rotated outputs are converted in square tiles of this many pixels, small
+// enough that a tile stays in the L1 cache while it's written out column by
+// column, and large enough that every row of a tile covers whole cache lines.
+#define CONVERT_TILE 64
+
+// Writes a converted tile of w x h pixels to the destination, transposed;
+// the tile's column c goes to destination row 'destrows[c]', starting at
+// column 'destx', and in reverse if 'reverse' is set.
+static void transpose_tile(uint32_t *destbuf, size_t deststride,
+		const uint32_t *tile, int w, int h, const size_t *destrows,
+		size_t destx, bool reverse) {
+	int c = 0;
+#if defined(USE_SSE) && defined(__SSE2__)
+	for (; c + 4 <= w; c += 4) {
+		int r = 0;
+		for (; r + 4 <= h; r += 4) {
+			const uint32_t *t = tile + r * CONVERT_TILE + c;
+			__m128i r0 = _mm_load_si128((const __m128i *)(t + 0 * CONVERT_TILE));
+			__m128i r1 = _mm_load_si128((const __m128i *)(t + 1 * CONVERT_TILE));
+			__m128i r2 = _mm_load_si128((const __m128i *)(t + 2 * CONVERT_TILE));
+			__m128i r3 = _mm_load_si128((const __m128i *)(t + 3 * CONVERT_TILE));
+			__m128i t0 = _mm_unpacklo_epi32(r0, r1);
+			__m128i t1 = _mm_unpacklo_epi32(r2, r3);
+			__m128i t2 = _mm_unpackhi_epi32(r0, r1);
+			__m128i t3 = _mm_unpackhi_epi32(r2, r3);
+			__m128i cols[4] = {
+				_mm_unpacklo_epi64(t0, t1),
+				_mm_unpackhi_epi64(t0, t1),
+				_mm_unpacklo_epi64(t2, t3),
+				_mm_unpackhi_epi64(t2, t3),
+			};
+
+			size_t x = reverse ? destx + h - r - 4 : destx + r;
+			for (int k = 0; k < 4; ++k) {
+				__m128i col = cols[k];
+				if (reverse) {
+					col = _mm_shuffle_epi32(col, _MM_SHUFFLE(0, 1, 2, 3));
+				}
+				_mm_storeu_si128(
+						(__m128i *)(destbuf + destrows[c + k] * deststride + x), col);
 			}
 		}
-		break;
-	case WL_OUTPUT_TRANSFORM_90:
-		for (size_t desty = 0; desty < destheight; ++desty) {
-			size_t srcx = desty;
-			for (size_t destx = 0; destx < destwidth; ++destx) {
-				size_t srcy = destwidth - destx - 1;
-				*((uint32_t *)(destbuf + desty * deststride) + destx) =
-					*((uint32_t *)(srcbuf + srcy * srcstride) + srcx);
+
+		for (; r < h; ++r) {
+			size_t x = reverse ? destx + h - r - 1 : destx + r;
+			for (int k = 0; k < 4; ++k) {
+				destbuf[destrows[c + k] * deststride + x] = tile[r * CONVERT_TILE + c + k];
 			}
 		}
+	}
+#endif
+	for (; c < w; ++c) {
+		uint32_t *destrow = destbuf + destrows[c] * deststride;
+		for (int r = 0; r < h; ++r) {
+			destrow[reverse ? destx + h - r - 1 : destx + r] = tile[r * CONVERT_TILE + c];
+		}
+	}
+}
+
+static void reverse_row(uint32_t *row, size_t width) {
+	size_t i = 0, j = width - 1;
+#if defined(USE_SSE) && defined(__SSE2__)
+	// Swaps four pixels from each end at a time
+	for (; i + 8 <= j + 1; i += 4, j -= 4) {
+		__m128i lo = _mm_loadu_si128((__m128i *)(row + i));
+		__m128i hi = _mm_loadu_si128((__m128i *)(row + j - 3));
+		_mm_storeu_si128((__m128i *)(row + i),
+				_mm_shuffle_epi32(hi, _MM_SHUFFLE(0, 1, 2, 3)));
+		_mm_storeu_si128((__m128i *)(row + j - 3),
+				_mm_shuffle_epi32(lo, _MM_SHUFFLE(0, 1, 2, 3)));
+	}
+#endif
+	for (; i < j; ++i, --j) {
+		uint32_t tmp = row[i];
+		row[i] = row[j];
+		row[j] = tmp;
+	}
+}
+
+// Converts the pixels and applies the transform in one pass over the
+// screenshot. Every transform is some combination of swapping the axes
+// and then mirroring the destination's x and y axes.
+static cairo_surface_t *convert_buffer(const uint8_t *srcbuf,
+		const struct shm_format *format, uint32_t width, uint32_t height,
+		uint32_t stride, enum wl_output_transform transform) {
+	bool swap = false, flipx = false, flipy = false;
+	switch (transform) {
+	case WL_OUTPUT_TRANSFORM_NORMAL:
+		break;
+	case WL_OUTPUT_TRANSFORM_90:
+		swap = flipx = true;
 		break;
 	case WL_OUTPUT_TRANSFORM_180:
-		for (size_t desty = 0; desty < destheight; ++desty) {
-			size_t srcy = destheight - desty - 1;
-			for (size_t destx = 0; destx < destwidth; ++destx) {
-				size_t srcx = destwidth - destx - 1;
-				*((uint32_t *)(destbuf + desty * deststride) + destx) =
-					*((uint32_t *)(srcbuf + srcy * srcstride) + srcx);
-			}
-		}
+		flipx = flipy = true;
 		break;
 	case WL_OUTPUT_TRANSFORM_270:
-		for (size_t desty = 0; desty < destheight; ++desty) {
-			size_t srcx = destheight - desty - 1;
-			for (size_t destx = 0; destx < destwidth; ++destx) {
-				size_t srcy = destx;
-				*((uint32_t *)(destbuf + desty * deststride) + destx) =
-					*((uint32_t *)(srcbuf + srcy * srcstride) + srcx);
-			}
-		}
+		swap = flipy = true;
 		break;
 	case WL_OUTPUT_TRANSFORM_FLIPPED:
-		for (size_t desty = 0; desty < destheight; ++desty) {
-			size_t srcy = desty;
-			for (size_t destx = 0; destx < destwidth; ++destx) {
-				size_t srcx = destwidth - destx - 1;
-				*((uint32_t *)(destbuf + desty * deststride) + destx) =
-					*((uint32_t *)(srcbuf + srcy * srcstride) + srcx);
-			}
-		}
+		flipx = true;
 		break;
 	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
-		for (size_t desty = 0; desty < destheight; ++desty) {
-			size_t srcx = desty;
-			for (size_t destx = 0; destx < destwidth; ++destx) {
-				size_t srcy = destx;
-				*((uint32_t *)(destbuf + desty * deststride) + destx) =
-					*((uint32_t *)(srcbuf + srcy * srcstride) + srcx);
-			}
-		}
+		swap = true;
 		break;
 	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
-		for (size_t desty = 0; desty < destheight; ++desty) {
-			size_t srcy = destheight - desty - 1;
-			memcpy(destbuf + desty * deststride, srcbuf + srcy * srcstride, minstride);
-		}
+		flipy = true;
 		break;
 	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-		for (size_t desty = 0; desty < destheight; ++desty) {
-			size_t srcx = destheight - desty - 1;
-			for (size_t destx = 0; destx < destwidth; ++destx) {
-				size_t srcy = destwidth - destx - 1;
-				*((uint32_t *)(destbuf + desty * deststride) + destx) =
-					*((uint32_t *)(srcbuf + srcy * srcstride) + srcx);
-			}
-		}
+		swap = flipx = flipy = true;
 		break;
 	}
 
-	if (format == WL_SHM_FORMAT_XBGR8888 || format == WL_SHM_FORMAT_ABGR8888) {
-		cairo_rgb24_from_xbgr32_le(
-				cairo_image_surface_get_data(image),
-				cairo_image_surface_get_width(image),
-				cairo_image_surface_get_height(image),
-				cairo_image_surface_get_stride(image));
+	cairo_surface_t *image;
+	if (swap) {
+		image = cairo_image_surface_create(CAIRO_FORMAT_RGB24, height, width);
 	} else {
-		if (format != WL_SHM_FORMAT_XRGB8888 && format != WL_SHM_FORMAT_ARGB8888) {
-			waylogout_log(LOG_ERROR,
-					"Unknown pixel format: %u. Assuming XRGB32. Colors may look wrong.",
-					format);
+		image = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	}
+	if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
+		waylogout_log(LOG_ERROR, "Failed to create image..");
+		cairo_surface_destroy(image);
+		return NULL;
+	}
+
+	cairo_surface_flush(image);
+	uint32_t *destbuf = (uint32_t *)cairo_image_surface_get_data(image);
+	size_t deststride = cairo_image_surface_get_stride(image) / 4;
+
+	if (!swap) {
+		// Rows stay rows, so every row is converted straight into place
+#pragma omp parallel for
+		for (uint32_t y = 0; y < height; ++y) {
+			uint32_t *destrow = destbuf + (flipy ? height - y - 1 : y) * deststride;
+			format->convert(destrow, srcbuf + (size_t)y * stride, width);
+			if (flipx) {
+				reverse_row(destrow, width);
+			}
+		}
+
+		cairo_surface_mark_dirty(image);
+		return image;
+	}
+
+	// Source rows become destination columns. Reading a column of the
+	// source would touch a new cache line for every pixel, so the source is
+	// converted in tiles, row by row, and each tile is written out transposed.
+	const uint32_t tiles_y = (height + CONVERT_TILE - 1) / CONVERT_TILE;
+#pragma omp parallel for
+	for (uint32_t ty = 0; ty < tiles_y; ++ty) {
+		alignas(16) uint32_t tile[CONVERT_TILE * CONVERT_TILE];
+		size_t destrows[CONVERT_TILE];
+		uint32_t y0 = ty * CONVERT_TILE;
+		int h = height - y0 < CONVERT_TILE ? height - y0 : CONVERT_TILE;
+
+		// The destination columns that this band of source rows maps to
+		size_t destx = flipx ? height - y0 - h : y0;
+
+		for (uint32_t x0 = 0; x0 < width; x0 += CONVERT_TILE) {
+			int w = width - x0 < CONVERT_TILE ? width - x0 : CONVERT_TILE;
+			for (int r = 0; r < h; ++r) {
+				format->convert(tile + r * CONVERT_TILE,
+						srcbuf + (size_t)(y0 + r) * stride + (size_t)x0 * format->bytes, w);
+			}
+			for (int c = 0; c < w; ++c) {
+				destrows[c] = flipy ? width - x0 - c - 1 : x0 + c;
+			}
+			transpose_tile(destbuf, deststride, tile, w, h, destrows, destx, flipx);
+		}
+	}
+
+	cairo_surface_mark_dirty(image);
+	return image;
+}
+
+cairo_surface_t *load_background_from_buffer(void *buf, uint32_t format,
+		uint32_t width, uint32_t height, uint32_t stride, enum wl_output_transform transform) {
+	return convert_buffer(buf, shm_format_get(format),
+			width, height, stride, transform);
+}
+
+static const cairo_user_data_key_t mapping_key;
+
+cairo_surface_t *load_background_from_mapping(void *buf, uint32_t format,
+		uint32_t width, uint32_t height, uint32_t stride,
+		enum wl_output_transform transform,
+		void (*release)(void *data), void *data) {
+	// An untransformed XRGB8888 or ARGB8888 screenshot already is RGB24,
+	// as far as the effects are concerned, on little endian
+	int test = 1;
+	bool is_little_endian = *(char *)&test == 1;
+	if (is_little_endian && transform == WL_OUTPUT_TRANSFORM_NORMAL &&
+			(format == WL_SHM_FORMAT_XRGB8888 || format == WL_SHM_FORMAT_ARGB8888) &&
+			stride % 4 == 0 && stride >= width * 4) {
+		cairo_surface_t *image = cairo_image_surface_create_for_data(
+				buf, CAIRO_FORMAT_RGB24, width, height, stride);
+		if (cairo_surface_status(image) == CAIRO_STATUS_SUCCESS &&
+				cairo_surface_set_user_data(image, &mapping_key,
+					data, release) == CAIRO_STATUS_SUCCESS) {
+			return image;
 		}
+		cairo_surface_destroy(image);
+	}
+
+	cairo_surface_t *image = load_background_from_buffer(buf, format,
+			width, height, stride, transform);
+	release(data);
+	return image;
+}
 
-		// If we're little endian, we don't have to do anything
-		int test = 1;
-		bool is_little_endian = *(char *)&test == 1;
-		if (!is_little_endian) {
-			cairo_rgb24_from_xrgb32_le(
-					cairo_image_surface_get_data(image),
-					cairo_image_surface_get_width(image),
-					cairo_image_surface_get_height(image),
-					cairo_image_surface_get_stride(image));
+cairo_surface_t *load_preview_from_buffer(void *buf, uint32_t format,
+		uint32_t width, uint32_t height, uint32_t stride,
+		enum wl_output_transform transform, uint32_t factor) {
+	const struct shm_format *shm_format = shm_format_get(format);
+	uint32_t smallwidth = width / factor > 0 ? width / factor : 1;
+	uint32_t smallheight = height / factor > 0 ? height / factor : 1;
+	uint32_t *small = malloc((size_t)smallwidth * smallheight * 4);
+	if (small == NULL) {
+		return NULL;
+	}
+
+	// Each pixel averages four samples from its block, which is plenty for
+	// something that gets upscaled right away
+	uint32_t near = factor / 4, far = factor - 1 - factor / 4;
+	for (uint32_t y = 0; y < smallheight; ++y) {
+		uint32_t y0 = y * factor + near, y1 = y * factor + far;
+		if (y1 >= height) {
+			y0 = y1 = height - 1;
+		}
+		const uint8_t *row0 = (uint8_t *)buf + (size_t)y0 * stride;
+		const uint8_t *row1 = (uint8_t *)buf + (size_t)y1 * stride;
+		for (uint32_t x = 0; x < smallwidth; ++x) {
+			uint32_t x0 = x * factor + near, x1 = x * factor + far;
+			if (x1 >= width) {
+				x0 = x1 = width - 1;
+			}
+
+			uint32_t samples[4];
+			shm_format->convert(&samples[0], row0 + x0 * shm_format->bytes, 1);
+			shm_format->convert(&samples[1], row0 + x1 * shm_format->bytes, 1);
+			shm_format->convert(&samples[2], row1 + x0 * shm_format->bytes, 1);
+			shm_format->convert(&samples[3], row1 + x1 * shm_format->bytes, 1);
+
+			uint32_t pix = 0;
+			for (int shift = 0; shift < 24; shift += 8) {
+				uint32_t sum = 2;
+				for (int i = 0; i < 4; ++i) {
+					sum += samples[i] >> shift & 0xff;
+				}
+				pix |= (sum / 4) << shift;
+			}
+			small[(size_t)y * smallwidth + x] = pix;
 		}
 	}
 
+	// The samples are RGB24 already, so only the transform is left to do
+	static const struct shm_format native = { 0, 4, convert_native };
+	cairo_surface_t *image = convert_buffer((uint8_t *)small, &native,
+			smallwidth, smallheight, smallwidth * 4, transform);
+	free(small);
 	return image;
 }
 
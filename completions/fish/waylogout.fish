@@ -1,12 +1,15 @@
 # waylogout(1) completion
 
+complete -c waylogout -l buffers                     --description "Sets how many buffers each surface is drawn into in turn."
 complete -c waylogout -l color                  -s c --description "Turn the screen into the given color instead of white."
 complete -c waylogout -l config                 -s C --description "Path to the config file."
 complete -c waylogout -l debug                  -s d --description "Enable debugging output."
 complete -c waylogout -l effect-blur                 --description "Blur displayed images."
 complete -c waylogout -l effect-compose              --description "Overlay another image to your lock screen."
 complete -c waylogout -l effect-custom               --description "Load a custom effect from a shared object."
+complete -c waylogout -l effect-gaussian             --description "Blur displayed images with a gaussian blur."
 complete -c waylogout -l effect-greyscale            --description "Make the displayed image greyscale."
+complete -c waylogout -l effect-kawase               --description "Blur displayed images with a faster approximation of --effect-blur."
 complete -c waylogout -l effect-pixelate             --description "Pixelate displayed images."
 complete -c waylogout -l effect-scale                --description "Scale the image by a factor."
 complete -c waylogout -l effect-vignette             --description "Apply a vignette effect to images."
@@ -46,5 +49,8 @@ complete -c waylogout -l symbol-font-size            --description "Sets a fixed
 complete -c waylogout -l text-color                  --description "Sets the color of the text."
 complete -c waylogout -l text-selection-color        --description "Sets the color of the text for the selected action indicator."
 complete -c waylogout -l tiling                 -s t --description "Same as --scaling=tile."
+complete -c waylogout -l precompile-effects          --description "Compile the custom effects written in C, then exit."
+complete -c waylogout -l progressive                 --description "Show a preview of the screenshot while its effects run."
+complete -c waylogout -l render-scale                --description "Run the effects on screenshots at a fraction of the resolution."
 complete -c waylogout -l time-effects                --description "Measure the time it takes to run each effect."
 complete -c waylogout -l version                -s v --description "Show the version number and quit."
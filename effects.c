@@ -1,20 +1,32 @@
 #define _POSIX_C_SOURCE 200809
 #define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
 #include <omp.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <dlfcn.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/utsname.h>
 #include <unistd.h>
 #include <spawn.h>
 #include <time.h>
 #include <stdio.h>
+#include <math.h>
+#include <inttypes.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__linux__)
+#include <sys/auxv.h>
+#endif
 #include "effects.h"
+#include "fnv.h"
 #include "log.h"
 
 // glib might or might not have already defined MIN,
@@ -53,17 +65,220 @@ static int screen_pos_to_pix(struct waylogout_effect_screen_pos pos, int screens
 static const char *effect_name(struct waylogout_effect *effect) {
 	switch (effect->tag) {
 	case EFFECT_BLUR: return "blur";
+	case EFFECT_GAUSSIAN: return "gaussian";
+	case EFFECT_KAWASE: return "kawase";
 	case EFFECT_PIXELATE: return "pixelate";
 	case EFFECT_SCALE: return "scale";
 	case EFFECT_GREYSCALE: return "greyscale";
 	case EFFECT_VIGNETTE: return "vignette";
 	case EFFECT_COMPOSE: return "compose";
-	case EFFECT_CUSTOM: return effect->e.custom;
+	case EFFECT_CUSTOM: return effect->e.custom.path;
 	}
 
 	abort();
 }
 
+// Full-frame buffers for the effects come from an arena, which keeps them
+// around once they're no longer used instead of giving them back to the
+// system. An effect that can't work in place writes to a new surface and
+// destroys its input, which puts the input's buffer straight back in the
+// arena for the next effect, so a chain ping-pongs between two buffers plus
+// one for scratch space. The arena is shared by all threads and outlives
+// the runs, so an output of the same size as the last one doesn't allocate.
+#define ARENA_ALIGN (2 * 1024 * 1024)
+#define ARENA_HUGEPAGE_MIN (4 * 1024 * 1024)
+
+struct arena_buffer {
+	void *data;
+	size_t size;
+	void *map; // the mapping, which may start before data
+	size_t mapsize;
+	struct arena_buffer *next;
+};
+
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct arena_buffer *arena_free = NULL;
+
+// Bytes taken from the arena by the current thread, for --time-effects
+static _Thread_local size_t arena_in_use = 0;
+static _Thread_local size_t arena_peak = 0;
+
+static const cairo_user_data_key_t arena_key;
+
+static struct arena_buffer *arena_map(size_t size) {
+	struct arena_buffer *buffer = calloc(1, sizeof(*buffer));
+	if (size < ARENA_HUGEPAGE_MIN) {
+		buffer->mapsize = size;
+		buffer->map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		buffer->data = buffer->map;
+	} else {
+		// Large buffers are aligned to, and padded to, the size of a huge
+		// page, so that all of them can be backed by huge pages
+		size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+		buffer->mapsize = size + ARENA_ALIGN;
+		buffer->map = mmap(NULL, buffer->mapsize, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		buffer->data = (void *)(((uintptr_t)buffer->map + ARENA_ALIGN - 1) &
+				~(uintptr_t)(ARENA_ALIGN - 1));
+	}
+
+	if (buffer->map == MAP_FAILED) {
+		waylogout_log_errno(LOG_ERROR, "Failed to map %zu bytes for effects", size);
+		free(buffer);
+		return NULL;
+	}
+
+#ifdef MADV_HUGEPAGE
+	if (size >= ARENA_HUGEPAGE_MIN) {
+		madvise(buffer->data, size, MADV_HUGEPAGE);
+	}
+#endif
+	buffer->size = size;
+	return buffer;
+}
+
+static void arena_unmap(struct arena_buffer *buffer) {
+	munmap(buffer->map, buffer->mapsize);
+	free(buffer);
+}
+
+// Takes the smallest free buffer of at least 'size' bytes out of the arena,
+// mapping a new one if there is none
+static struct arena_buffer *arena_get(size_t size) {
+	pthread_mutex_lock(&arena_lock);
+	struct arena_buffer **best = NULL;
+	for (struct arena_buffer **iter = &arena_free; *iter; iter = &(*iter)->next) {
+		if ((*iter)->size >= size && (best == NULL || (*iter)->size < (*best)->size)) {
+			best = iter;
+		}
+	}
+
+	struct arena_buffer *buffer = NULL;
+	if (best) {
+		buffer = *best;
+		*best = buffer->next;
+	}
+	pthread_mutex_unlock(&arena_lock);
+
+	if (buffer == NULL) {
+		buffer = arena_map(size);
+		if (buffer == NULL) {
+			return NULL;
+		}
+	}
+
+	buffer->next = NULL;
+	arena_in_use += buffer->size;
+	if (arena_in_use > arena_peak) {
+		arena_peak = arena_in_use;
+	}
+	return buffer;
+}
+
+static void arena_put(struct arena_buffer *buffer) {
+	arena_in_use -= buffer->size < arena_in_use ? buffer->size : arena_in_use;
+
+	pthread_mutex_lock(&arena_lock);
+	buffer->next = arena_free;
+	arena_free = buffer;
+	pthread_mutex_unlock(&arena_lock);
+}
+
+// Makes sure that the arena has 'count' free buffers of at least 'size'
+// bytes, so that a run doesn't have to map any more halfway through
+static void arena_reserve(size_t size, int count) {
+	pthread_mutex_lock(&arena_lock);
+	for (struct arena_buffer *iter = arena_free; iter && count > 0; iter = iter->next) {
+		if (iter->size >= size) {
+			count -= 1;
+		}
+	}
+	pthread_mutex_unlock(&arena_lock);
+
+	for (; count > 0; --count) {
+		struct arena_buffer *buffer = arena_map(size);
+		if (buffer == NULL) {
+			return;
+		}
+		pthread_mutex_lock(&arena_lock);
+		buffer->next = arena_free;
+		arena_free = buffer;
+		pthread_mutex_unlock(&arena_lock);
+	}
+}
+
+static void arena_surface_destroy(void *data) {
+	arena_put(data);
+}
+
+// Creates an RGB24 surface whose pixels live in the arena; destroying the
+// surface puts them back
+static cairo_surface_t *arena_surface_create(int width, int height) {
+	int stride = cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, width);
+	struct arena_buffer *buffer = arena_get((size_t)stride * height);
+	if (buffer == NULL) {
+		return cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	}
+
+	cairo_surface_t *surface = cairo_image_surface_create_for_data(
+			buffer->data, CAIRO_FORMAT_RGB24, width, height, stride);
+	if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS ||
+			cairo_surface_set_user_data(surface, &arena_key,
+				buffer, arena_surface_destroy) != CAIRO_STATUS_SUCCESS) {
+		// Nothing would put the buffer back, and the surface mustn't
+		// outlive it
+		cairo_surface_destroy(surface);
+		arena_put(buffer);
+		return cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	}
+	return surface;
+}
+
+void waylogout_effects_trim(void) {
+	pthread_mutex_lock(&arena_lock);
+	struct arena_buffer *buffer = arena_free;
+	arena_free = NULL;
+	pthread_mutex_unlock(&arena_lock);
+
+	while (buffer) {
+		struct arena_buffer *next = buffer->next;
+		arena_unmap(buffer);
+		buffer = next;
+	}
+}
+
+// The pixels of an image as the effects see them. Rows are 'stride' pixels
+// apart, which can be more than 'width'. Every pixel is 32 bits with red,
+// green and blue in the low 24; the top byte is never read, so that the
+// effects can work on an ARGB32 surface in place, as if it were RGB24.
+struct effect_image {
+	uint32_t *data;
+	int width, height;
+	int stride;
+};
+
+static struct effect_image effect_image_of(cairo_surface_t *surface) {
+	return (struct effect_image){
+		.data = (uint32_t *)cairo_image_surface_get_data(surface),
+		.width = cairo_image_surface_get_width(surface),
+		.height = cairo_image_surface_get_height(surface),
+		.stride = cairo_image_surface_get_stride(surface) / sizeof(uint32_t),
+	};
+}
+
+static void effect_image_copy(struct effect_image dest, struct effect_image src) {
+	if (dest.stride == src.stride && src.stride == src.width) {
+		memcpy(dest.data, src.data, (size_t)src.width * src.height * sizeof(uint32_t));
+		return;
+	}
+
+	for (int y = 0; y < src.height; ++y) {
+		memcpy(dest.data + (size_t)y * dest.stride, src.data + (size_t)y * src.stride,
+				src.width * sizeof(uint32_t));
+	}
+}
+
 static void screen_pos_pair_to_pix(
 		struct waylogout_effect_screen_pos posx,
 		struct waylogout_effect_screen_pos posy,
@@ -128,14 +343,14 @@ static uint32_t blend_pixels(float alpha, uint32_t srcpix, uint32_t destpix) {
 		(uint32_t)(srcb + destb * (1 - alpha)) << 0;
 }
 
-static void blur_h(uint32_t *dest, uint32_t *src, int width, int height,
-		int radius) {
+static void blur_h(uint32_t *dest, int dstride, uint32_t *src, int sstride,
+		int width, int height, int radius, const uint32_t *recip) {
 	const int minradius = radius < width ? radius : width;
 
 #pragma omp parallel for
 	for (int y = 0; y < height; ++y) {
-		uint32_t *srow = src + y * width;
-		uint32_t *drow = dest + y * width;
+		uint32_t *srow = src + y * sstride;
+		uint32_t *drow = dest + y * dstride;
 
 		// 'range' is float, because floating point division is usually faster
 		// than integer division.
@@ -175,318 +390,1266 @@ static void blur_h(uint32_t *dest, uint32_t *src, int width, int height,
 	}
 }
 
-static void blur_v(uint32_t *dest, uint32_t *src, int width, int height,
-		int radius) {
-	const int minradius = radius < height ? radius : height;
-
-#pragma omp parallel for
-	for (int x = 0; x < width; ++x) {
-		uint32_t *scol = src + x;
-		uint32_t *dcol = dest + x;
-
-		// 'range' is float, because floating point division is usually faster
-		// than integer division.
-		int r_acc = 0;
-		int g_acc = 0;
-		int b_acc = 0;
-		float range = minradius;
+// The vertical pass walks down a strip of BLUR_V_STRIP neighbouring columns
+// row by row, with one set of accumulators per column, instead of walking
+// each column on its own with a stride of a whole row. Every step then reads
+// and writes a few whole cache lines, and since every thread gets its own
+// strips, threads don't end up sharing cache lines either.
+#define BLUR_V_STRIP 64
 
-		// Accumulate the range (0..radius)
-		for (int y = 0; y < minradius; ++y) {
-			r_acc += (scol[y * width] & 0xff0000) >> 16;
-			g_acc += (scol[y * width] & 0x00ff00) >> 8;
-			b_acc += (scol[y * width] & 0x0000ff);
+static void blur_v_strip(uint32_t *dest, int dstride, uint32_t *src, int sstride,
+		int width, int height, int radius, int x0, int x1, const uint32_t *recip) {
+	const int minradius = radius < height ? radius : height;
+	const int n = x1 - x0;
+
+	// 'range' is float, because floating point division is usually faster
+	// than integer division.
+	int r_acc[BLUR_V_STRIP] = { 0 };
+	int g_acc[BLUR_V_STRIP] = { 0 };
+	int b_acc[BLUR_V_STRIP] = { 0 };
+	float range = minradius;
+
+	// Accumulate the range (0..radius)
+	for (int y = 0; y < minradius; ++y) {
+		uint32_t *srow = src + y * sstride + x0;
+		for (int i = 0; i < n; ++i) {
+			r_acc[i] += (srow[i] & 0xff0000) >> 16;
+			g_acc[i] += (srow[i] & 0x00ff00) >> 8;
+			b_acc[i] += (srow[i] & 0x0000ff);
 		}
+	}
 
-		// Deal with the main body
-		for (int y = 0; y < height; ++y) {
-			if (y >= minradius) {
-				r_acc -= (scol[(y - radius) * width] & 0xff0000) >> 16;
-				g_acc -= (scol[(y - radius) * width] & 0x00ff00) >> 8;
-				b_acc -= (scol[(y - radius) * width] & 0x0000ff);
-				range -= 1;
+	// Deal with the main body
+	for (int y = 0; y < height; ++y) {
+		if (y >= minradius) {
+			uint32_t *srow = src + (y - radius) * sstride + x0;
+			for (int i = 0; i < n; ++i) {
+				r_acc[i] -= (srow[i] & 0xff0000) >> 16;
+				g_acc[i] -= (srow[i] & 0x00ff00) >> 8;
+				b_acc[i] -= (srow[i] & 0x0000ff);
 			}
+			range -= 1;
+		}
 
-			if (y < height - minradius) {
-				r_acc += (scol[(y + radius) * width] & 0xff0000) >> 16;
-				g_acc += (scol[(y + radius) * width] & 0x00ff00) >> 8;
-				b_acc += (scol[(y + radius) * width] & 0x0000ff);
-				range += 1;
+		if (y < height - minradius) {
+			uint32_t *srow = src + (y + radius) * sstride + x0;
+			for (int i = 0; i < n; ++i) {
+				r_acc[i] += (srow[i] & 0xff0000) >> 16;
+				g_acc[i] += (srow[i] & 0x00ff00) >> 8;
+				b_acc[i] += (srow[i] & 0x0000ff);
 			}
+			range += 1;
+		}
 
-			dcol[y * width] = 0 |
-				(int)(r_acc / range) << 16 |
-				(int)(g_acc / range) << 8 |
-				(int)(b_acc / range);
+		uint32_t *drow = dest + y * dstride + x0;
+		for (int i = 0; i < n; ++i) {
+			drow[i] = 0 |
+				(int)(r_acc[i] / range) << 16 |
+				(int)(g_acc[i] / range) << 8 |
+				(int)(b_acc[i] / range);
 		}
 	}
 }
 
-static void blur_once(uint32_t *dest, uint32_t *src, uint32_t *scratch,
-		int width, int height, int radius) {
-	blur_h(scratch, src, width, height, radius);
-	blur_v(dest, scratch, width, height, radius);
+// The SIMD kernels divide by multiplying with a 1.31 fixed-point reciprocal,
+// floor(acc * (floor(2^31 / range) + 1) / 2^31).
+// That equals floor(acc / range), which is what the float division in the
+// scalar kernels produces, as long as 255 * range^2 < 2^31.
+// For larger ranges, blur_kernel_select falls back to the scalar kernels.
+// The table is built once per blur, for every pass in both directions.
+#define BLUR_SIMD_MAX_RANGE 2900
+
+static uint32_t *blur_reciprocals(int max_range) {
+	uint32_t *recip = malloc((max_range + 1) * sizeof(*recip));
+	if (recip == NULL) {
+		return NULL;
+	}
+	recip[0] = 0;
+	for (int d = 1; d <= max_range; ++d) {
+		recip[d] = (uint32_t)((UINT64_C(1) << 31) / d + 1);
+	}
+	return recip;
 }
 
-// This effect_blur function, and the associated blur_* functions,
-// are my own adaptations of code in yvbbrjdr's i3lock-fancy-rapid:
-// https://github.com/yvbbrjdr/i3lock-fancy-rapid
-static void effect_blur(uint32_t *dest, uint32_t *src, int width, int height, int scale,
-		int radius, int times) {
-	uint32_t *origdest = dest;
+#if defined(USE_SSE) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_BLUR_SIMD
+#include <immintrin.h>
 
-	uint32_t *scratch = malloc(width * height * sizeof(*scratch));
-	blur_once(dest, src, scratch, width, height, radius * scale);
-	for (int i = 0; i < times - 1; ++i) {
-		uint32_t *tmp = src;
-		src = dest;
-		dest = tmp;
-		blur_once(dest, src, scratch, width, height, radius * scale);
-	}
-	free(scratch);
+__attribute__((target("sse4.1")))
+static inline __m128i blur_divide_sse41(__m128i acc, uint32_t recip) {
+	__m128i m = _mm_set1_epi32(recip);
+	__m128i even = _mm_srli_epi64(_mm_mul_epu32(acc, m), 31);
+	__m128i odd = _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(acc, 32), m), 1);
+	return _mm_blend_epi16(even, odd, 0xcc);
+}
 
-	// We're flipping between using dest and src;
-	// if the last buffer we used was src, copy that over to dest.
-	if (dest != origdest)
-		memcpy(origdest, dest, width * height * sizeof(*dest));
+__attribute__((target("sse4.1")))
+static inline __m128i blur_load_sse41(uint32_t pix) {
+	return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(pix));
 }
 
-static void effect_pixelate(uint32_t *data, int width, int height, int scale, int factor) {
-	factor *= scale;
-#pragma omp parallel for
-	for (int y = 0; y < height / factor + 1; ++y) {
-		for (int x = 0; x < width / factor + 1; ++x) {
-			int total_r = 0, total_g = 0, total_b = 0;
+__attribute__((target("sse4.1")))
+static inline uint32_t blur_store_sse41(__m128i q) {
+	q = _mm_packus_epi32(q, q);
+	q = _mm_packus_epi16(q, q);
+	return (uint32_t)_mm_cvtsi128_si32(q) & 0x00ffffff;
+}
 
-			int xstart = x * factor;
-			int ystart = y * factor;
-			int xlim = MIN(xstart + factor, width);
-			int ylim = MIN(ystart + factor, height);
+// One row, with the B, G, R and padding channels of a pixel in the four
+// lanes of one register.
+__attribute__((target("sse4.1")))
+static void blur_h_row_sse41(uint32_t *drow, uint32_t *srow, int width,
+		int radius, int minradius, const uint32_t *recip) {
+	__m128i acc = _mm_setzero_si128();
+	int range = minradius;
 
-			// Average
-			for (int ry = ystart; ry < ylim; ++ry) {
-				for (int rx = xstart; rx < xlim; ++rx) {
-					int index = ry * width + rx;
-					total_r += (data[index] & 0xff0000) >> 16;
-					total_g += (data[index] & 0x00ff00) >> 8;
-					total_b += (data[index] & 0x0000ff);
-				}
-			}
+	for (int x = 0; x < minradius; ++x) {
+		acc = _mm_add_epi32(acc, blur_load_sse41(srow[x]));
+	}
 
-			int r = total_r / (factor * factor);
-			int g = total_g / (factor * factor);
-			int b = total_b / (factor * factor);
+	for (int x = 0; x < width; ++x) {
+		if (x >= minradius) {
+			acc = _mm_sub_epi32(acc, blur_load_sse41(srow[x - radius]));
+			range -= 1;
+		}
 
-			// Fill pixels
-			for (int ry = ystart; ry < ylim; ++ry) {
-				for (int rx = xstart; rx < xlim; ++rx) {
-					int index = ry * width + rx;
-					data[index] = r << 16 | g << 8 | b;
-				}
-			}
+		if (x < width - minradius) {
+			acc = _mm_add_epi32(acc, blur_load_sse41(srow[x + radius]));
+			range += 1;
 		}
+
+		drow[x] = blur_store_sse41(blur_divide_sse41(acc, recip[range]));
 	}
 }
 
-static void effect_scale(uint32_t *dest, uint32_t *src, int swidth, int sheight,
-		double scale) {
-	int dwidth = swidth * scale;
-	int dheight = sheight * scale;
-	double fact = 1.0 / scale;
+__attribute__((target("sse4.1")))
+static void blur_h_sse41(uint32_t *dest, int dstride, uint32_t *src, int sstride,
+		int width, int height, int radius, const uint32_t *recip) {
+	const int minradius = radius < width ? radius : width;
 
 #pragma omp parallel for
-	for (int dy = 0; dy < dheight; ++dy) {
-		int sy = dy * fact;
-		if (sy >= sheight) continue;
-		for (int dx = 0; dx < dwidth; ++dx) {
-			int sx = dx * fact;
-			if (sx >= swidth) continue;
-			dest[dy * dwidth + dx] = src[sy * swidth + sx];
-		}
+	for (int y = 0; y < height; ++y) {
+		blur_h_row_sse41(dest + y * dstride, src + y * sstride, width,
+				radius, minradius, recip);
 	}
 }
 
-static void effect_greyscale(uint32_t *data, int width, int height) {
-#pragma omp parallel for
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			int index = y * width + x;
-			int r = (data[index] & 0xff0000) >> 16;
-			int g = (data[index] & 0x00ff00) >> 8;
-			int b = (data[index] & 0x0000ff);
-			int luma = 0.2989 * r + 0.5870 * g + 0.1140 * b;
-			if (luma < 0) luma = 0;
-			if (luma > 255) luma = 255;
-			luma &= 0xFF;
-			data[index] = luma << 16 | luma << 8 | luma;
+// One pixel per register.
+__attribute__((target("sse4.1")))
+static void blur_v_strip_sse41(uint32_t *dest, int dstride, uint32_t *src, int sstride,
+		int width, int height, int radius, int x0, int x1, const uint32_t *recip) {
+	const int minradius = radius < height ? radius : height;
+	const int n = x1 - x0;
+	__m128i acc[BLUR_V_STRIP];
+	int range = minradius;
+
+	for (int i = 0; i < n; ++i) {
+		acc[i] = _mm_setzero_si128();
+	}
+
+	for (int y = 0; y < minradius; ++y) {
+		uint32_t *srow = src + y * sstride + x0;
+		for (int i = 0; i < n; ++i) {
+			acc[i] = _mm_add_epi32(acc[i], blur_load_sse41(srow[i]));
 		}
 	}
-}
 
-static void effect_vignette(uint32_t *data, int width, int height,
-		double base, double factor) {
-	base = fmin(1, fmax(0, base));
-	factor = fmin(1 - base, fmax(0, factor));
-#pragma omp parallel for
 	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-
-			double xf = (x * 1.0) / width;
-			double yf = (y * 1.0) / height;
-			double vignette_factor = base + factor
-				* 16 * xf * yf * (1.0 - xf) * (1.0 - yf);
-
-			int index = y * width + x;
-			int r = (data[index] & 0xff0000) >> 16;
-			int g = (data[index] & 0x00ff00) >> 8;
-			int b = (data[index] & 0x0000ff);
+		if (y >= minradius) {
+			uint32_t *srow = src + (y - radius) * sstride + x0;
+			for (int i = 0; i < n; ++i) {
+				acc[i] = _mm_sub_epi32(acc[i], blur_load_sse41(srow[i]));
+			}
+			range -= 1;
+		}
 
-			r = (int)(r * vignette_factor) & 0xFF;
-			g = (int)(g * vignette_factor) & 0xFF;
-			b = (int)(b * vignette_factor) & 0xFF;
+		if (y < height - minradius) {
+			uint32_t *srow = src + (y + radius) * sstride + x0;
+			for (int i = 0; i < n; ++i) {
+				acc[i] = _mm_add_epi32(acc[i], blur_load_sse41(srow[i]));
+			}
+			range += 1;
+		}
 
-			data[index] = r << 16 | g << 8 | b;
+		uint32_t *drow = dest + y * dstride + x0;
+		for (int i = 0; i < n; ++i) {
+			drow[i] = blur_store_sse41(blur_divide_sse41(acc[i], recip[range]));
 		}
 	}
 }
 
-static void effect_compose(uint32_t *data, int width, int height, int scale,
-		struct waylogout_effect_screen_pos posx,
-		struct waylogout_effect_screen_pos posy,
-		struct waylogout_effect_screen_pos posw,
-		struct waylogout_effect_screen_pos posh,
-		int gravity, char *imgpath) {
-#if !HAVE_GDK_PIXBUF
-	(void)&blend_pixels;
-	(void)&screen_size_to_pix;
-	(void)&screen_pos_pair_to_pix;
-	waylogout_log(LOG_ERROR, "Compose effect: Compiled without gdk_pixbuf support.\n");
-	return;
-#else
-	int imgw = screen_size_to_pix(posw, width, scale);
-	int imgh = screen_size_to_pix(posh, height, scale);
-	bool preserve_aspect = imgw < 0 || imgh < 0;
+__attribute__((target("avx2")))
+static inline __m256i blur_divide_avx2(__m256i acc, uint32_t recip) {
+	__m256i m = _mm256_set1_epi32(recip);
+	__m256i even = _mm256_srli_epi64(_mm256_mul_epu32(acc, m), 31);
+	__m256i odd = _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(acc, 32), m), 1);
+	return _mm256_blend_epi32(even, odd, 0xaa);
+}
 
-	GError *err = NULL;
-	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file_at_scale(
-			imgpath, imgw, imgh, preserve_aspect, &err);
-	if (!pixbuf) {
-		waylogout_log(LOG_ERROR, "Compose effect: Failed to load image file '%s' (%s).",
-				imgpath, err->message);
-		g_error_free(err);
-		return;
-	}
+// Unpacks two pixels into the two 128-bit halves of a register.
+__attribute__((target("avx2")))
+static inline __m256i blur_load2_avx2(uint32_t lo, uint32_t hi) {
+	return _mm256_cvtepu8_epi32(_mm_set_epi32(0, 0, hi, lo));
+}
 
-	cairo_surface_t *image = gdk_cairo_image_surface_create_from_pixbuf(pixbuf);
-	g_object_unref(pixbuf);
+__attribute__((target("avx2")))
+static inline __m256i blur_loadu2_avx2(uint32_t *pix) {
+	return _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)pix));
+}
 
-	int bufw = cairo_image_surface_get_width(image);
-	int bufh = cairo_image_surface_get_height(image);
-	uint32_t *bufdata = (uint32_t *)cairo_image_surface_get_data(image);
-	int bufstride = cairo_image_surface_get_stride(image) / 4;
-	bool bufalpha = cairo_image_surface_get_format(image) == CAIRO_FORMAT_ARGB32;
+__attribute__((target("avx2")))
+static inline __m128i blur_store2_avx2(__m256i q) {
+	q = _mm256_packus_epi32(q, q);
+	q = _mm256_packus_epi16(q, q);
+	q = _mm256_and_si256(q, _mm256_set1_epi32(0x00ffffff));
+	return _mm_unpacklo_epi32(
+			_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+}
 
-	int imgx, imgy;
-	screen_pos_pair_to_pix(
-			posx, posy, bufw, bufh,
-			width, height, scale, gravity,
-			&imgx, &imgy);
+// Two rows at a time, one in each 128-bit half of the registers.
+__attribute__((target("avx2")))
+static void blur_h_avx2(uint32_t *dest, int dstride, uint32_t *src, int sstride,
+		int width, int height, int radius, const uint32_t *recip) {
+	const int minradius = radius < width ? radius : width;
 
 #pragma omp parallel for
-	for (int offy = 0; offy < bufh; ++offy) {
-		if (offy + imgy < 0 || offy + imgy > height)
-			continue;
+	for (int y = 0; y < height - 1; y += 2) {
+		uint32_t *srow0 = src + y * sstride;
+		uint32_t *srow1 = srow0 + sstride;
+		uint32_t *drow0 = dest + y * dstride;
+		uint32_t *drow1 = drow0 + dstride;
+		__m256i acc = _mm256_setzero_si256();
+		int range = minradius;
 
-		for (int offx = 0; offx < bufw; ++offx) {
-			if (offx + imgx < 0 || offx + imgx > width)
-				continue;
+		for (int x = 0; x < minradius; ++x) {
+			acc = _mm256_add_epi32(acc, blur_load2_avx2(srow0[x], srow1[x]));
+		}
 
-			size_t idx = (size_t)(offy + imgy) * width + (offx + imgx);
-			size_t bufidx = (size_t)offy * bufstride + (offx);
+		for (int x = 0; x < width; ++x) {
+			if (x >= minradius) {
+				acc = _mm256_sub_epi32(acc,
+						blur_load2_avx2(srow0[x - radius], srow1[x - radius]));
+				range -= 1;
+			}
 
-			if (!bufalpha) {
-				data[idx] = bufdata[bufidx];
-			} else {
-				uint8_t alpha = (bufdata[bufidx] & 0xff000000) >> 24;
-				if (alpha == 255) {
-					data[idx] = bufdata[bufidx];
-				} else if (alpha != 0) {
-					data[idx] = blend_pixels(alpha / 255.0, bufdata[bufidx], data[idx]);
-				}
+			if (x < width - minradius) {
+				acc = _mm256_add_epi32(acc,
+						blur_load2_avx2(srow0[x + radius], srow1[x + radius]));
+				range += 1;
 			}
+
+			__m128i pix = blur_store2_avx2(blur_divide_avx2(acc, recip[range]));
+			drow0[x] = (uint32_t)_mm_cvtsi128_si32(pix);
+			drow1[x] = (uint32_t)_mm_extract_epi32(pix, 1);
 		}
 	}
 
-	cairo_surface_destroy(image);
-#endif
+	if (height % 2 != 0) {
+		blur_h_row_sse41(dest + (height - 1) * dstride, src + (height - 1) * sstride,
+				width, radius, minradius, recip);
+	}
 }
 
-static void effect_custom_run(uint32_t *data, int width, int height, int scale,
-		char *path) {
-	void *dl = dlopen(path, RTLD_LAZY);
-	if (dl == NULL) {
-		waylogout_log(LOG_ERROR, "Custom effect: %s", dlerror());
-		return;
+// Two neighbouring columns per register.
+__attribute__((target("avx2")))
+static void blur_v_strip_avx2(uint32_t *dest, int dstride, uint32_t *src, int sstride,
+		int width, int height, int radius, int x0, int x1, const uint32_t *recip) {
+	const int minradius = radius < height ? radius : height;
+	const int pairs = (x1 - x0) / 2;
+	__m256i acc[BLUR_V_STRIP / 2];
+	int range = minradius;
+
+	for (int i = 0; i < pairs; ++i) {
+		acc[i] = _mm256_setzero_si256();
 	}
 
-	void (*effect_func)(uint32_t *data, int width, int height, int scale) =
-		dlsym(dl, "waylogout_effect");
-	if (effect_func != NULL) {
-		effect_func(data, width, height, scale);
-		dlclose(dl);
-		return;
+	for (int y = 0; y < minradius; ++y) {
+		uint32_t *srow = src + y * sstride + x0;
+		for (int i = 0; i < pairs; ++i) {
+			acc[i] = _mm256_add_epi32(acc[i], blur_loadu2_avx2(srow + i * 2));
+		}
 	}
 
-	uint32_t (*pixel_func)(uint32_t pix, int x, int y, int width, int height) =
-		dlsym(dl, "waylogout_pixel");
-	if (pixel_func != NULL) {
-#pragma omp parallel for
-		for (int y = 0; y < height; ++y) {
-			for (int x = 0; x < width; ++x) {
-				data[y * width + x] =
-					pixel_func(data[y * width + x], x, y, width, height);
+	for (int y = 0; y < height; ++y) {
+		if (y >= minradius) {
+			uint32_t *srow = src + (y - radius) * sstride + x0;
+			for (int i = 0; i < pairs; ++i) {
+				acc[i] = _mm256_sub_epi32(acc[i], blur_loadu2_avx2(srow + i * 2));
 			}
+			range -= 1;
 		}
 
-		dlclose(dl);
-		return;
+		if (y < height - minradius) {
+			uint32_t *srow = src + (y + radius) * sstride + x0;
+			for (int i = 0; i < pairs; ++i) {
+				acc[i] = _mm256_add_epi32(acc[i], blur_loadu2_avx2(srow + i * 2));
+			}
+			range += 1;
+		}
+
+		uint32_t *drow = dest + y * dstride + x0;
+		for (int i = 0; i < pairs; ++i) {
+			_mm_storel_epi64((__m128i *)(drow + i * 2),
+					blur_store2_avx2(blur_divide_avx2(acc[i], recip[range])));
+		}
 	}
 
-	(void)dlsym(dl, "waylogout_effect"); // Change the result of dlerror()
-	waylogout_log(LOG_ERROR, "Custom effect: %s", dlerror());
+	// The last column, if the strip has an odd width
+	if (x0 + pairs * 2 < x1) {
+		blur_v_strip_sse41(dest, dstride, src, sstride, width, height, radius,
+				x1 - 1, x1, recip);
+	}
 }
 
-static bool file_is_outdated(const char *input, const char *output) {
-	struct stat instat, outstat;
-	if (stat(input, &instat) < 0) {
-		return true;
+#endif // USE_SSE && x86
+
+// 'recip' is the table from blur_reciprocals, for the kernels that divide
+// with it, and NULL for the others
+struct blur_kernel {
+	const char *name;
+	bool reciprocals;
+	void (*blur_h)(uint32_t *dest, int dstride, uint32_t *src, int sstride,
+			int width, int height, int radius, const uint32_t *recip);
+	void (*blur_v_strip)(uint32_t *dest, int dstride, uint32_t *src, int sstride,
+			int width, int height, int radius, int x0, int x1, const uint32_t *recip);
+};
+
+static const struct blur_kernel blur_kernel_scalar =
+	{ "scalar", false, blur_h, blur_v_strip };
+
+static const struct blur_kernel *blur_kernel_select(int width, int height, int radius) {
+#ifdef HAVE_BLUR_SIMD
+	static const struct blur_kernel blur_kernel_sse41 =
+		{ "sse4.1", true, blur_h_sse41, blur_v_strip_sse41 };
+	static const struct blur_kernel blur_kernel_avx2 =
+		{ "avx2", true, blur_h_avx2, blur_v_strip_avx2 };
+
+	int maxdim = width > height ? width : height;
+	int minradius = radius < maxdim ? radius : maxdim;
+	if (2 * minradius <= BLUR_SIMD_MAX_RANGE) {
+		if (__builtin_cpu_supports("avx2")) {
+			return &blur_kernel_avx2;
+		} else if (__builtin_cpu_supports("sse4.1")) {
+			return &blur_kernel_sse41;
+		}
 	}
+#endif
 
-	if (stat(output, &outstat) < 0) {
-		return true;
-	}
+	return &blur_kernel_scalar;
+}
 
-	if (instat.st_mtim.tv_sec > outstat.st_mtim.tv_sec) {
-		return true;
+static void blur_v(const struct blur_kernel *kernel,
+		uint32_t *dest, int dstride, uint32_t *src, int sstride,
+		int width, int height, int radius, const uint32_t *recip) {
+	const int strips = (width + BLUR_V_STRIP - 1) / BLUR_V_STRIP;
+
+#pragma omp parallel for
+	for (int strip = 0; strip < strips; ++strip) {
+		int x0 = strip * BLUR_V_STRIP;
+		kernel->blur_v_strip(dest, dstride, src, sstride, width, height, radius,
+				x0, MIN(x0 + BLUR_V_STRIP, width), recip);
 	}
+}
 
-	if (
-			instat.st_mtim.tv_sec == outstat.st_mtim.tv_sec &&
-			instat.st_mtim.tv_nsec >= outstat.st_mtim.tv_nsec) {
-		return true;
+// The reciprocals for every pass of a blur with the kernel, or NULL if it
+// needs none. If they can't be had, the kernel falls back to the scalar one.
+static uint32_t *blur_kernel_reciprocals(const struct blur_kernel **kernel,
+		int width, int height, int radius) {
+	if (!(*kernel)->reciprocals) {
+		return NULL;
 	}
+	int maxdim = width > height ? width : height;
+	uint32_t *recip = blur_reciprocals(2 * (radius < maxdim ? radius : maxdim));
+	if (recip == NULL) {
+		*kernel = &blur_kernel_scalar;
+	}
+	return recip;
+}
 
-	return false;
+// The scratch buffer has no padding between its rows
+static void blur_once(const struct blur_kernel *kernel, const uint32_t *recip,
+		uint32_t *dest, int dstride, uint32_t *src, int sstride, uint32_t *scratch,
+		int width, int height, int radius) {
+	kernel->blur_h(scratch, width, src, sstride, width, height, radius, recip);
+	blur_v(kernel, dest, dstride, scratch, width, width, height, radius, recip);
 }
 
-static char *effect_custom_compile(const char *path) {
-	static char *cachepath = NULL;
-	static size_t cachelen;
-	if (!cachepath) {
+// This effect_blur function, and the associated blur_* functions,
+// are my own adaptations of code in yvbbrjdr's i3lock-fancy-rapid:
+// https://github.com/yvbbrjdr/i3lock-fancy-rapid
+static void effect_blur(struct effect_image dest, struct effect_image src, int scale,
+		int radius, int times) {
+	struct effect_image origdest = dest;
+	int width = src.width, height = src.height;
+	const struct blur_kernel *kernel =
+		blur_kernel_select(width, height, radius * scale);
+	waylogout_log(LOG_DEBUG, "Blur effect: using the %s kernel", kernel->name);
+
+	struct arena_buffer *scratch = arena_get((size_t)width * height * sizeof(uint32_t));
+	if (scratch == NULL) {
+		effect_image_copy(dest, src);
+		return;
+	}
+	uint32_t *recip = blur_kernel_reciprocals(&kernel, width, height, radius * scale);
+	blur_once(kernel, recip, dest.data, dest.stride, src.data, src.stride,
+			scratch->data, width, height, radius * scale);
+	for (int i = 0; i < times - 1; ++i) {
+		struct effect_image tmp = src;
+		src = dest;
+		dest = tmp;
+		blur_once(kernel, recip, dest.data, dest.stride, src.data, src.stride,
+				scratch->data, width, height, radius * scale);
+	}
+	free(recip);
+	arena_put(scratch);
+
+	// We're flipping between using dest and src;
+	// if the last buffer we used was src, copy that over to dest.
+	if (dest.data != origdest.data)
+		effect_image_copy(origdest, dest);
+}
+
+// Coefficients for Young and van Vliet's recursive Gaussian filter
+// ("Recursive implementation of the Gaussian filter", Signal Processing,
+// 1995), normalized so that w[n] = B*x[n] + b1*w[n-1] + b2*w[n-2] + b3*w[n-3].
+// Running it forwards and then backwards over a line approximates a Gaussian
+// blur with the given sigma, at a cost per pixel which doesn't depend on sigma.
+struct gaussian_coefs {
+	float B, b1, b2, b3;
+};
+
+static struct gaussian_coefs gaussian_coefs(double sigma) {
+	double q;
+	if (sigma >= 2.5) {
+		q = 0.98711 * sigma - 0.96330;
+	} else {
+		q = 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+	}
+
+	double q2 = q * q;
+	double q3 = q2 * q;
+	double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+	double b1 = 2.44413 * q + 2.85619 * q2 + 1.26661 * q3;
+	double b2 = -(1.4281 * q2 + 1.26661 * q3);
+	double b3 = 0.422205 * q3;
+
+	return (struct gaussian_coefs) {
+		.B = 1 - (b1 + b2 + b3) / b0,
+		.b1 = b1 / b0,
+		.b2 = b2 / b0,
+		.b3 = b3 / b0,
+	};
+}
+
+// Runs the filter forwards and then backwards over 'len' steps of 'n'
+// independent lines, stored interleaved as block[step * n + line].
+// Keeping many lines side by side like this lets the compiler vectorize the
+// recursion, which is strictly serial along any single line.
+// The block must have room for GAUSSIAN_PAD extra steps before and after;
+// those are filled so that the edges act as if the first and last value
+// extended forever.
+#define GAUSSIAN_PAD 3
+
+static void gaussian_step(float *restrict cur, const float *restrict w1,
+		const float *restrict w2, const float *restrict w3, int n,
+		struct gaussian_coefs c) {
+	for (int i = 0; i < n; ++i) {
+		cur[i] = c.B * cur[i] + c.b1 * w1[i] + c.b2 * w2[i] + c.b3 * w3[i];
+	}
+}
+
+static void gaussian_lines(float *block, int len, int n, struct gaussian_coefs c) {
+	for (int k = 1; k <= GAUSSIAN_PAD; ++k) {
+		memcpy(block - k * n, block, n * sizeof(*block));
+	}
+	for (int k = 0; k < len; ++k) {
+		float *cur = block + k * n;
+		gaussian_step(cur, cur - n, cur - 2 * n, cur - 3 * n, n, c);
+	}
+
+	for (int k = 1; k <= GAUSSIAN_PAD; ++k) {
+		memcpy(block + (len - 1 + k) * n, block + (len - 1) * n, n * sizeof(*block));
+	}
+	for (int k = len - 1; k >= 0; --k) {
+		float *cur = block + k * n;
+		gaussian_step(cur, cur + n, cur + 2 * n, cur + 3 * n, n, c);
+	}
+}
+
+static void gaussian_unpack(float *rgb, uint32_t pix) {
+	rgb[0] = (pix & 0xff0000) >> 16;
+	rgb[1] = (pix & 0x00ff00) >> 8;
+	rgb[2] = (pix & 0x0000ff);
+}
+
+static uint32_t gaussian_pack(const float *rgb) {
+	uint32_t pix = 0;
+	for (int ch = 0; ch < 3; ++ch) {
+		int val = rgb[ch] + 0.5f;
+		if (val < 0) val = 0;
+		if (val > 255) val = 255;
+		pix = pix << 8 | val;
+	}
+	return pix;
+}
+
+// The horizontal pass works on bands of this many rows at a time,
+// transposed so that the rows of a band sit next to each other.
+#define GAUSSIAN_H_BAND 16
+
+static size_t gaussian_h_block(int width) {
+	return (size_t)(width + 2 * GAUSSIAN_PAD) * GAUSSIAN_H_BAND * 3;
+}
+
+// 'blocks' holds 'threads' blocks of gaussian_h_block(width) floats, one
+// for each thread
+static void gaussian_h(uint32_t *dest, int dstride, uint32_t *src, int sstride,
+		int width, int height, struct gaussian_coefs c,
+		float *blocks, int threads) {
+	const int bands = (height + GAUSSIAN_H_BAND - 1) / GAUSSIAN_H_BAND;
+
+#pragma omp parallel num_threads(threads)
+	{
+		float *mem = blocks + omp_get_thread_num() * gaussian_h_block(width);
+
+#pragma omp for
+		for (int band = 0; band < bands; ++band) {
+			const int y0 = band * GAUSSIAN_H_BAND;
+			const int rows = MIN(GAUSSIAN_H_BAND, height - y0);
+			const int n = rows * 3;
+			float *block = mem + GAUSSIAN_PAD * n;
+
+			for (int r = 0; r < rows; ++r) {
+				uint32_t *srow = src + (y0 + r) * sstride;
+				for (int x = 0; x < width; ++x) {
+					gaussian_unpack(&block[x * n + r * 3], srow[x]);
+				}
+			}
+
+			gaussian_lines(block, width, n, c);
+
+			for (int r = 0; r < rows; ++r) {
+				uint32_t *drow = dest + (y0 + r) * dstride;
+				for (int x = 0; x < width; ++x) {
+					drow[x] = gaussian_pack(&block[x * n + r * 3]);
+				}
+			}
+		}
+	}
+}
+
+// The vertical pass works on strips of columns, like blur_v. The strips are
+// narrower than blur_v's, so that a strip's worth of floats stays in cache.
+#define GAUSSIAN_V_STRIP 16
+
+static size_t gaussian_v_block(int height) {
+	return (size_t)(height + 2 * GAUSSIAN_PAD) * GAUSSIAN_V_STRIP * 3;
+}
+
+static void gaussian_v(uint32_t *dest, int dstride, uint32_t *src, int sstride,
+		int width, int height, struct gaussian_coefs c,
+		float *blocks, int threads) {
+	const int strips = (width + GAUSSIAN_V_STRIP - 1) / GAUSSIAN_V_STRIP;
+
+#pragma omp parallel num_threads(threads)
+	{
+		float *mem = blocks + omp_get_thread_num() * gaussian_v_block(height);
+
+#pragma omp for
+		for (int strip = 0; strip < strips; ++strip) {
+			const int x0 = strip * GAUSSIAN_V_STRIP;
+			const int cols = MIN(GAUSSIAN_V_STRIP, width - x0);
+			const int n = cols * 3;
+			float *block = mem + GAUSSIAN_PAD * n;
+
+			for (int y = 0; y < height; ++y) {
+				uint32_t *srow = src + y * sstride + x0;
+				for (int i = 0; i < cols; ++i) {
+					gaussian_unpack(&block[y * n + i * 3], srow[i]);
+				}
+			}
+
+			gaussian_lines(block, height, n, c);
+
+			for (int y = 0; y < height; ++y) {
+				uint32_t *drow = dest + y * dstride + x0;
+				for (int i = 0; i < cols; ++i) {
+					drow[i] = gaussian_pack(&block[y * n + i * 3]);
+				}
+			}
+		}
+	}
+}
+
+static void effect_gaussian(struct effect_image dest, struct effect_image src,
+		int scale, double sigma) {
+	int width = src.width, height = src.height;
+	sigma *= scale;
+
+	// The filter coefficients are only valid from a sigma of 0.5 up;
+	// anything less than that is practically no blur anyway.
+	if (!isfinite(sigma) || sigma < 0.5) {
+		effect_image_copy(dest, src);
+		return;
+	}
+
+	struct gaussian_coefs c = gaussian_coefs(sigma);
+	struct arena_buffer *scratch = arena_get((size_t)width * height * sizeof(uint32_t));
+	if (scratch == NULL) {
+		effect_image_copy(dest, src);
+		return;
+	}
+
+	// Both passes share the threads' blocks, sized for the larger of them
+	int threads = omp_get_max_threads();
+	size_t block = gaussian_h_block(width);
+	if (gaussian_v_block(height) > block) {
+		block = gaussian_v_block(height);
+	}
+	struct arena_buffer *blocks = arena_get(threads * block * sizeof(float));
+	if (blocks == NULL) {
+		arena_put(scratch);
+		effect_image_copy(dest, src);
+		return;
+	}
+
+	gaussian_h(scratch->data, width, src.data, src.stride, width, height, c,
+			blocks->data, threads);
+	gaussian_v(dest.data, dest.stride, scratch->data, width, width, height, c,
+			blocks->data, threads);
+	arena_put(blocks);
+	arena_put(scratch);
+}
+
+// Dual Kawase blur (Marius Bjørge, "Bandwidth-Efficient Rendering",
+// SIGGRAPH 2015): the image is repeatedly downsampled to half its size
+// with a small filter, and then upsampled back up level by level with
+// another small filter. Every level blurs its input a little, but since the
+// levels shrink, the total blur grows exponentially with the number of
+// levels while the total work stays below two full-resolution passes.
+//
+// Both filters sample between pixels with bilinear filtering, which works
+// out to fixed 4x4 kernels on the pixels of the source level.
+// The downsample kernel is the same for every destination pixel:
+// the centre 2x2 pixels weighted 4 times, plus the 4 diagonal 2x2 blocks.
+static const int kawase_down_kernel[4][4] = {
+	{ 1, 1, 1, 1 },
+	{ 1, 5, 5, 1 },
+	{ 1, 5, 5, 1 },
+	{ 1, 1, 1, 1 },
+};
+
+#define KAWASE_DOWN_WEIGHT 32
+#define KAWASE_UP_WEIGHT 192
+#define KAWASE_MAX_LEVELS 16
+
+// The upsample kernel depends on whether the destination pixel's x and y
+// coordinates are even or odd. It's built from the 8 upsampling taps
+// at (+-1, 0), (0, +-1) and, with double weight, (+-0.5, +-0.5) source pixels.
+static void kawase_up_kernel(int kernel[2][2][4][4]) {
+	static const int taps[8][3] = {
+		{ -4, 0, 1 }, { 4, 0, 1 }, { 0, -4, 1 }, { 0, 4, 1 },
+		{ -2, -2, 2 }, { 2, -2, 2 }, { -2, 2, 2 }, { 2, 2, 2 },
+	};
+
+	// The destination pixel centre, in quarter source pixels, relative to
+	// the top left pixel of the 4x4 block of source pixels the taps hit
+	static const int base[2] = { 7, 5 };
+
+	memset(kernel, 0, sizeof(int[2][2][4][4]));
+	for (int py = 0; py < 2; ++py) {
+		for (int px = 0; px < 2; ++px) {
+			int (*k)[4] = kernel[py][px];
+			for (int t = 0; t < 8; ++t) {
+				int cx = base[px] + taps[t][0];
+				int cy = base[py] + taps[t][1];
+				int x0 = cx / 4, ax = cx % 4;
+				int y0 = cy / 4, ay = cy % 4;
+				k[y0][x0] += (4 - ax) * (4 - ay) * taps[t][2];
+				k[y0][x0 + 1] += ax * (4 - ay) * taps[t][2];
+				k[y0 + 1][x0] += (4 - ax) * ay * taps[t][2];
+				k[y0 + 1][x0 + 1] += ax * ay * taps[t][2];
+			}
+		}
+	}
+}
+
+static inline uint32_t kawase_divide(uint32_t r, uint32_t g, uint32_t b, uint32_t weight) {
+	r = (r + weight / 2) / weight;
+	g = (g + weight / 2) / weight;
+	b = (b + weight / 2) / weight;
+	return r << 16 | g << 8 | b;
+}
+
+static inline uint32_t kawase_pixel(uint32_t *rows[4], const int *xs,
+		const int (*k)[4], uint32_t weight) {
+	// Red and blue are summed together in one integer, one in each
+	// 16-bit half; the weights are small enough that they can't overflow.
+	uint32_t rb = 0, g = 0;
+	for (int ky = 0; ky < 4; ++ky) {
+		for (int kx = 0; kx < 4; ++kx) {
+			uint32_t pix = rows[ky][xs[kx]];
+			rb += k[ky][kx] * (pix & 0xff00ff);
+			g += k[ky][kx] * (pix & 0x00ff00);
+		}
+	}
+
+	return kawase_divide(rb >> 16, g >> 8, rb & 0xffff, weight);
+}
+
+#if defined(USE_SSE) && defined(__SSE2__)
+#include <emmintrin.h>
+
+// One kernel row, with every weight repeated for each channel of its pixel:
+// 'lo' holds the weights of the row's first two pixels, 'hi' the last two's.
+struct kawase_row_weights {
+	__m128i lo, hi;
+};
+
+static void kawase_row_weights(struct kawase_row_weights w[4], const int (*k)[4]) {
+	for (int ky = 0; ky < 4; ++ky) {
+		w[ky].lo = _mm_set_epi16(
+				k[ky][1], k[ky][1], k[ky][1], k[ky][1],
+				k[ky][0], k[ky][0], k[ky][0], k[ky][0]);
+		w[ky].hi = _mm_set_epi16(
+				k[ky][3], k[ky][3], k[ky][3], k[ky][3],
+				k[ky][2], k[ky][2], k[ky][2], k[ky][2]);
+	}
+}
+
+// Same as kawase_pixel, for pixels whose 4 source columns aren't clamped
+// and thus can be loaded at once. Every channel's sum fits in 16 bits.
+static inline uint32_t kawase_pixel_sse2(uint32_t *rows[4], int x0,
+		const struct kawase_row_weights w[4], uint32_t weight) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	for (int ky = 0; ky < 4; ++ky) {
+		__m128i pix = _mm_loadu_si128((const __m128i *)&rows[ky][x0]);
+		acc = _mm_add_epi16(acc, _mm_mullo_epi16(_mm_unpacklo_epi8(pix, zero), w[ky].lo));
+		acc = _mm_add_epi16(acc, _mm_mullo_epi16(_mm_unpackhi_epi8(pix, zero), w[ky].hi));
+	}
+	acc = _mm_add_epi16(acc, _mm_srli_si128(acc, 8));
+
+	// Divide with rounding; (x * 43691) >> 23 is exactly x / 192 for
+	// every x below 2^16, and 32 is a plain shift.
+	acc = _mm_add_epi16(acc, _mm_set1_epi16(weight / 2));
+	if (weight == KAWASE_UP_WEIGHT) {
+		acc = _mm_srli_epi16(_mm_mulhi_epu16(acc, _mm_set1_epi16((short)43691)), 7);
+	} else {
+		acc = _mm_srli_epi16(acc, 5);
+	}
+	return (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(acc, acc)) & 0xffffff;
+}
+#endif
+
+// Filters 'src' into 'dest' with 4x4 kernels. The kernel for destination
+// pixel (x, y) starts at source pixel (origin(x), origin(y)), where
+// origin(x) = x * 2 - 1 when downsampling and (x + 1) / 2 - 2 when upsampling.
+// Pixels outside the source are clamped to the edge.
+// 'cols' is room for 4 ints per destination column.
+static void kawase_pass(uint32_t *dest, int dwidth, int dheight, int dstride,
+		uint32_t *src, int swidth, int sheight, int sstride,
+		const int (*up_kernel)[2][4][4], int *cols) {
+	bool up = up_kernel != NULL;
+	const uint32_t weight = up ? KAWASE_UP_WEIGHT : KAWASE_DOWN_WEIGHT;
+
+	// Which 4 source columns each destination column reads
+	for (int x = 0; x < dwidth; ++x) {
+		int origin = up ? (x + 1) / 2 - 2 : x * 2 - 1;
+		for (int k = 0; k < 4; ++k) {
+			int sx = origin + k;
+			cols[x * 4 + k] = sx < 0 ? 0 : sx >= swidth ? swidth - 1 : sx;
+		}
+	}
+
+	// The kernel for each parity of x and y
+	const int (*kernels[2][2])[4];
+	for (int py = 0; py < 2; ++py) {
+		for (int px = 0; px < 2; ++px) {
+			kernels[py][px] = up ? up_kernel[py][px] : kawase_down_kernel;
+		}
+	}
+
+#if defined(USE_SSE) && defined(__SSE2__)
+	struct kawase_row_weights weights[2][2][4];
+	for (int py = 0; py < 2; ++py) {
+		for (int px = 0; px < 2; ++px) {
+			kawase_row_weights(weights[py][px], kernels[py][px]);
+		}
+	}
+#endif
+
+#pragma omp parallel for
+	for (int y = 0; y < dheight; ++y) {
+		int origin = up ? (y + 1) / 2 - 2 : y * 2 - 1;
+		uint32_t *rows[4];
+		for (int k = 0; k < 4; ++k) {
+			int sy = origin + k;
+			rows[k] = src + (sy < 0 ? 0 : sy >= sheight ? sheight - 1 : sy) * sstride;
+		}
+
+		uint32_t *drow = dest + y * dstride;
+		int x = 0;
+#if defined(USE_SSE) && defined(__SSE2__)
+		// Columns with unclamped source pixels, in pairs of even and odd x
+		for (; x < dwidth && cols[x * 4 + 3] - cols[x * 4] != 3; ++x) {
+			drow[x] = kawase_pixel(rows, &cols[x * 4], kernels[y & 1][x & 1], weight);
+		}
+		const struct kawase_row_weights *w0 = weights[y & 1][x & 1];
+		const struct kawase_row_weights *w1 = weights[y & 1][(x + 1) & 1];
+		for (; x + 1 < dwidth && cols[x * 4 + 7] - cols[x * 4 + 4] == 3; x += 2) {
+			drow[x] = kawase_pixel_sse2(rows, cols[x * 4], w0, weight);
+			drow[x + 1] = kawase_pixel_sse2(rows, cols[x * 4 + 4], w1, weight);
+		}
+#endif
+		for (; x < dwidth; ++x) {
+			drow[x] = kawase_pixel(rows, &cols[x * 4], kernels[y & 1][x & 1], weight);
+		}
+	}
+}
+
+// Each level roughly doubles the blur's standard deviation; this was
+// measured from the impulse response of the filters above.
+static double kawase_sigma(int levels) {
+	return 0.9 * (1 << levels);
+}
+
+static void effect_kawase(struct effect_image dest, struct effect_image src,
+		int scale, int radius, int times) {
+	int width = src.width, height = src.height;
+
+	// A box blur with a window of 2r pixels, run t times, has a standard
+	// deviation of about r * sqrt(t / 3). Pick the number of levels that
+	// comes closest to that, but stop before the smallest level gets
+	// narrower than a couple of pixels.
+	double sigma = radius * scale * sqrt(times / 3.0);
+	int levels = 1;
+	while (levels < KAWASE_MAX_LEVELS &&
+			(width >> (levels + 1)) >= 2 && (height >> (levels + 1)) >= 2 &&
+			fabs(kawase_sigma(levels + 1) - sigma) < fabs(kawase_sigma(levels) - sigma)) {
+		levels += 1;
+	}
+
+	int up_kernel[2][2][4][4];
+	kawase_up_kernel(up_kernel);
+
+	// All the levels together are about a third of the full image; they
+	// share one scratch buffer, without padding between their rows
+	int widths[KAWASE_MAX_LEVELS + 1], heights[KAWASE_MAX_LEVELS + 1];
+	int strides[KAWASE_MAX_LEVELS + 1];
+	uint32_t *data[KAWASE_MAX_LEVELS + 1];
+	size_t offsets[KAWASE_MAX_LEVELS + 1];
+	widths[0] = width;
+	heights[0] = height;
+	strides[0] = src.stride;
+	data[0] = src.data;
+	offsets[0] = 0;
+	for (int i = 1; i <= levels; ++i) {
+		widths[i] = (widths[i - 1] + 1) / 2;
+		heights[i] = (heights[i - 1] + 1) / 2;
+		strides[i] = widths[i];
+		offsets[i] = offsets[i - 1] + (i > 1 ? (size_t)widths[i - 1] * heights[i - 1] : 0);
+	}
+	size_t total = offsets[levels] + (size_t)widths[levels] * heights[levels];
+	struct arena_buffer *scratch = arena_get(total * sizeof(uint32_t));
+	if (scratch == NULL) {
+		effect_image_copy(dest, src);
+		return;
+	}
+	// The passes' column tables; the full-resolution level is the widest
+	struct arena_buffer *cols = arena_get((size_t)width * 4 * sizeof(int));
+	if (cols == NULL) {
+		arena_put(scratch);
+		effect_image_copy(dest, src);
+		return;
+	}
+	for (int i = 1; i <= levels; ++i) {
+		data[i] = (uint32_t *)scratch->data + offsets[i];
+	}
+
+	for (int i = 1; i <= levels; ++i) {
+		kawase_pass(data[i], widths[i], heights[i], strides[i],
+				data[i - 1], widths[i - 1], heights[i - 1], strides[i - 1],
+				NULL, cols->data);
+	}
+
+	// The upsampling passes write over the downsampled levels, which
+	// aren't needed any more once the level above has been produced.
+	// The last pass writes the full-resolution result to 'dest'.
+	data[0] = dest.data;
+	strides[0] = dest.stride;
+	for (int i = levels; i > 0; --i) {
+		kawase_pass(data[i - 1], widths[i - 1], heights[i - 1], strides[i - 1],
+				data[i], widths[i], heights[i], strides[i],
+				(const int (*)[2][4][4])up_kernel, cols->data);
+	}
+
+	arena_put(cols);
+	arena_put(scratch);
+}
+
+static void effect_pixelate(struct effect_image image, int scale, int factor) {
+	uint32_t *data = image.data;
+	int width = image.width, height = image.height;
+	factor *= scale;
+#pragma omp parallel for
+	for (int y = 0; y < height / factor + 1; ++y) {
+		for (int x = 0; x < width / factor + 1; ++x) {
+			int total_r = 0, total_g = 0, total_b = 0;
+
+			int xstart = x * factor;
+			int ystart = y * factor;
+			int xlim = MIN(xstart + factor, width);
+			int ylim = MIN(ystart + factor, height);
+
+			// Average
+			for (int ry = ystart; ry < ylim; ++ry) {
+				for (int rx = xstart; rx < xlim; ++rx) {
+					int index = ry * image.stride + rx;
+					total_r += (data[index] & 0xff0000) >> 16;
+					total_g += (data[index] & 0x00ff00) >> 8;
+					total_b += (data[index] & 0x0000ff);
+				}
+			}
+
+			int r = total_r / (factor * factor);
+			int g = total_g / (factor * factor);
+			int b = total_b / (factor * factor);
+
+			// Fill pixels
+			for (int ry = ystart; ry < ylim; ++ry) {
+				for (int rx = xstart; rx < xlim; ++rx) {
+					int index = ry * image.stride + rx;
+					data[index] = r << 16 | g << 8 | b;
+				}
+			}
+		}
+	}
+}
+
+static void effect_scale(struct effect_image dest, struct effect_image src,
+		double scale) {
+	int swidth = src.width, sheight = src.height;
+	int dwidth = dest.width, dheight = dest.height;
+	double fact = 1.0 / scale;
+
+#pragma omp parallel for
+	for (int dy = 0; dy < dheight; ++dy) {
+		int sy = dy * fact;
+		if (sy >= sheight) continue;
+		for (int dx = 0; dx < dwidth; ++dx) {
+			int sx = dx * fact;
+			if (sx >= swidth) continue;
+			dest.data[dy * dest.stride + dx] = src.data[sy * src.stride + sx];
+		}
+	}
+}
+
+static uint32_t greyscale_pixel(uint32_t pix) {
+	int r = (pix & 0xff0000) >> 16;
+	int g = (pix & 0x00ff00) >> 8;
+	int b = (pix & 0x0000ff);
+	int luma = 0.2989 * r + 0.5870 * g + 0.1140 * b;
+	if (luma < 0) luma = 0;
+	if (luma > 255) luma = 255;
+	luma &= 0xFF;
+	return luma << 16 | luma << 8 | luma;
+}
+
+static uint32_t vignette_pixel(uint32_t pix, int x, int y, int width, int height,
+		double base, double factor) {
+	double xf = (x * 1.0) / width;
+	double yf = (y * 1.0) / height;
+	double vignette_factor = base + factor
+		* 16 * xf * yf * (1.0 - xf) * (1.0 - yf);
+
+	int r = (pix & 0xff0000) >> 16;
+	int g = (pix & 0x00ff00) >> 8;
+	int b = (pix & 0x0000ff);
+
+	r = (int)(r * vignette_factor) & 0xFF;
+	g = (int)(g * vignette_factor) & 0xFF;
+	b = (int)(b * vignette_factor) & 0xFF;
+
+	return r << 16 | g << 8 | b;
+}
+
+static void effect_compose(struct effect_image dest, int scale,
+		struct waylogout_effect_screen_pos posx,
+		struct waylogout_effect_screen_pos posy,
+		struct waylogout_effect_screen_pos posw,
+		struct waylogout_effect_screen_pos posh,
+		int gravity, char *imgpath) {
+#if !HAVE_GDK_PIXBUF
+	(void)&blend_pixels;
+	(void)&screen_size_to_pix;
+	(void)&screen_pos_pair_to_pix;
+	waylogout_log(LOG_ERROR, "Compose effect: Compiled without gdk_pixbuf support.\n");
+	return;
+#else
+	uint32_t *data = dest.data;
+	int width = dest.width, height = dest.height;
+	int imgw = screen_size_to_pix(posw, width, scale);
+	int imgh = screen_size_to_pix(posh, height, scale);
+	bool preserve_aspect = imgw < 0 || imgh < 0;
+
+	GError *err = NULL;
+	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file_at_scale(
+			imgpath, imgw, imgh, preserve_aspect, &err);
+	if (!pixbuf) {
+		waylogout_log(LOG_ERROR, "Compose effect: Failed to load image file '%s' (%s).",
+				imgpath, err->message);
+		g_error_free(err);
+		return;
+	}
+
+	cairo_surface_t *image = gdk_cairo_image_surface_create_from_pixbuf(pixbuf);
+	g_object_unref(pixbuf);
+
+	int bufw = cairo_image_surface_get_width(image);
+	int bufh = cairo_image_surface_get_height(image);
+	uint32_t *bufdata = (uint32_t *)cairo_image_surface_get_data(image);
+	int bufstride = cairo_image_surface_get_stride(image) / 4;
+	bool bufalpha = cairo_image_surface_get_format(image) == CAIRO_FORMAT_ARGB32;
+
+	int imgx, imgy;
+	screen_pos_pair_to_pix(
+			posx, posy, bufw, bufh,
+			width, height, scale, gravity,
+			&imgx, &imgy);
+
+#pragma omp parallel for
+	for (int offy = 0; offy < bufh; ++offy) {
+		if (offy + imgy < 0 || offy + imgy >= height)
+			continue;
+
+		for (int offx = 0; offx < bufw; ++offx) {
+			if (offx + imgx < 0 || offx + imgx >= width)
+				continue;
+
+			size_t idx = (size_t)(offy + imgy) * dest.stride + (offx + imgx);
+			size_t bufidx = (size_t)offy * bufstride + (offx);
+
+			if (!bufalpha) {
+				data[idx] = bufdata[bufidx];
+			} else {
+				uint8_t alpha = (bufdata[bufidx] & 0xff000000) >> 24;
+				if (alpha == 255) {
+					data[idx] = bufdata[bufidx];
+				} else if (alpha != 0) {
+					data[idx] = blend_pixels(alpha / 255.0, bufdata[bufidx], data[idx]);
+				}
+			}
+		}
+	}
+
+	cairo_surface_destroy(image);
+#endif
+}
+
+// The plugin registry: every custom effect's shared object is opened once,
+// when the options are parsed, and stays open until exit.
+//
+// Version 1 plugins export one of effect_func and pixel_func.
+// Version 2 plugins export rows_func, which waylogout runs on bands of rows
+// in parallel, and optionally init_func and teardown_func, which create and
+// destroy whatever state rows_func needs for one image. rows_func may read
+// 'halo' rows above and below its band.
+struct waylogout_plugin {
+	char *path;
+	void *dl;
+	int version;
+	void (*effect_func)(uint32_t *data, int width, int height, int scale);
+	uint32_t (*pixel_func)(uint32_t pix, int x, int y, int width, int height);
+	void *(*init_func)(int width, int height, int scale);
+	void (*teardown_func)(void *state);
+	void (*rows_func)(uint32_t *data, int stride, int y0, int y1,
+			int width, int height, int scale, void *state);
+	int halo;
+
+	// While a C plugin is being compiled: the compiler's pid, the file it
+	// writes to, and where that file goes once it's done
+	pid_t compiler;
+	char *compiling_path;
+	char *compiled_path;
+
+	struct waylogout_plugin *next;
+};
+
+static struct waylogout_plugin *plugins = NULL;
+
+#define WAYLOGOUT_EFFECT_ABI_VERSION 2
+
+static bool plugin_open_v2(struct waylogout_plugin *plugin, void *dl, const char *path) {
+	const int *version = dlsym(dl, "waylogout_effect_version");
+	if (version == NULL || *version != WAYLOGOUT_EFFECT_ABI_VERSION) {
+		waylogout_log(LOG_ERROR, "Custom effect %s: exports waylogout_effect_rows, "
+				"but waylogout_effect_version is %s (expected %d)", path,
+				version == NULL ? "missing" : "unsupported", WAYLOGOUT_EFFECT_ABI_VERSION);
+		return false;
+	}
+
+	const int *halo = dlsym(dl, "waylogout_effect_halo");
+	if (halo != NULL && *halo < 0) {
+		waylogout_log(LOG_ERROR, "Custom effect %s: negative waylogout_effect_halo", path);
+		return false;
+	}
+
+	plugin->version = *version;
+	plugin->halo = halo == NULL ? 0 : *halo;
+	plugin->init_func = dlsym(dl, "waylogout_effect_init");
+	plugin->teardown_func = dlsym(dl, "waylogout_effect_teardown");
+	return true;
+}
+
+static bool plugin_open(struct waylogout_plugin *plugin, const char *path) {
+	void *dl = dlopen(path, RTLD_NOW);
+	if (dl == NULL) {
+		waylogout_log(LOG_ERROR, "Custom effect: %s", dlerror());
+		return false;
+	}
+
+	plugin->rows_func = dlsym(dl, "waylogout_effect_rows");
+	if (plugin->rows_func != NULL) {
+		if (!plugin_open_v2(plugin, dl, path)) {
+			dlclose(dl);
+			return false;
+		}
+		plugin->dl = dl;
+		return true;
+	}
+
+	plugin->version = 1;
+	plugin->effect_func = dlsym(dl, "waylogout_effect");
+	if (plugin->effect_func != NULL) {
+		plugin->dl = dl;
+		return true;
+	}
+
+	plugin->pixel_func = dlsym(dl, "waylogout_pixel");
+	if (plugin->pixel_func != NULL) {
+		plugin->dl = dl;
+		return true;
+	}
+
+	(void)dlsym(dl, "waylogout_effect"); // Change the result of dlerror()
+	waylogout_log(LOG_ERROR, "Custom effect: %s", dlerror());
+	dlclose(dl);
+	return false;
+}
+
+static void *plugin_init(struct waylogout_plugin *plugin, int width, int height, int scale) {
+	return plugin->init_func ? plugin->init_func(width, height, scale) : NULL;
+}
+
+static void plugin_teardown(struct waylogout_plugin *plugin, void *state) {
+	if (plugin->teardown_func) {
+		plugin->teardown_func(state);
+	}
+}
+
+#define PLUGIN_BAND_HEIGHT 64
+
+// Runs a version 2 plugin over the image in bands of rows. Without a halo,
+// every band works on the image in place. With one, a band's neighbours
+// would overwrite the rows it reads, so every band works on a private
+// copy of its rows and their halo, and is copied back once all are done.
+static void plugin_run_rows(struct waylogout_plugin *plugin,
+		struct effect_image image, int scale) {
+	uint32_t *data = image.data;
+	int width = image.width, height = image.height, stride = image.stride;
+	void *state = plugin_init(plugin, width, height, scale);
+	int halo = plugin->halo;
+	int band_height = PLUGIN_BAND_HEIGHT > 4 * halo ? PLUGIN_BAND_HEIGHT : 4 * halo;
+	int bands = (height + band_height - 1) / band_height;
+
+	if (halo == 0) {
+#pragma omp parallel for schedule(dynamic)
+		for (int band = 0; band < bands; ++band) {
+			int y0 = band * band_height;
+			int y1 = MIN(y0 + band_height, height);
+			plugin->rows_func(data, stride, y0, y1, width, height, scale, state);
+		}
+
+		plugin_teardown(plugin, state);
+		return;
+	}
+
+	// Every band's copy gets room for a full band and both halos
+	size_t band_size = (size_t)(band_height + 2 * halo) * stride;
+	struct arena_buffer *copies = arena_get(bands * band_size * sizeof(uint32_t));
+	if (copies == NULL) {
+		// A single band has no neighbours to overwrite its rows
+		waylogout_log(LOG_ERROR, "Custom effect: no memory for bands, "
+				"running it on the whole image at once");
+		plugin->rows_func(data, stride, 0, height, width, height, scale, state);
+		plugin_teardown(plugin, state);
+		return;
+	}
+
+#pragma omp parallel for schedule(dynamic)
+	for (int band = 0; band < bands; ++band) {
+		int y0 = band * band_height;
+		int y1 = MIN(y0 + band_height, height);
+		int start = y0 - halo < 0 ? 0 : y0 - halo;
+		int end = MIN(y1 + halo, height);
+		uint32_t *copy = (uint32_t *)copies->data + band * band_size;
+
+		memcpy(copy, data + (size_t)start * stride,
+				(size_t)(end - start) * stride * sizeof(uint32_t));
+
+		// The plugin addresses rows by their position in the image
+		uint32_t *base = copy - (size_t)start * stride;
+		plugin->rows_func(base, stride, y0, y1, width, height, scale, state);
+	}
+
+#pragma omp parallel for
+	for (int band = 0; band < bands; ++band) {
+		int y0 = band * band_height;
+		int y1 = MIN(y0 + band_height, height);
+		int start = y0 - halo < 0 ? 0 : y0 - halo;
+		uint32_t *copy = (uint32_t *)copies->data + band * band_size;
+		memcpy(data + (size_t)y0 * stride, copy + (size_t)(y0 - start) * stride,
+				(size_t)(y1 - y0) * stride * sizeof(uint32_t));
+	}
+
+	arena_put(copies);
+	plugin_teardown(plugin, state);
+}
+
+// Version 1 plugins assume that rows follow each other without padding,
+// so an image with padding is handed to them as a packed copy
+static void plugin_run_v1(struct waylogout_plugin *plugin,
+		struct effect_image image, int scale) {
+	if (image.stride == image.width) {
+		plugin->effect_func(image.data, image.width, image.height, scale);
+		return;
+	}
+
+	struct arena_buffer *packed =
+		arena_get((size_t)image.width * image.height * sizeof(uint32_t));
+	if (packed == NULL) {
+		return;
+	}
+	struct effect_image copy = {
+		.data = packed->data,
+		.width = image.width,
+		.height = image.height,
+		.stride = image.width,
+	};
+	effect_image_copy(copy, image);
+	plugin->effect_func(copy.data, copy.width, copy.height, scale);
+	effect_image_copy(image, copy);
+	arena_put(packed);
+}
+
+static const char *effect_cache_dir(void) {
+	static char *cachepath = NULL;
+	if (!cachepath) {
 		char *xdgdir = getenv("XDG_DATA_HOME");
 		if (xdgdir) {
 			cachepath = malloc(strlen(xdgdir) + strlen("/waylogout") + 1);
-			cachelen = sprintf(cachepath, "%s/waylogout", xdgdir);
+			sprintf(cachepath, "%s/waylogout", xdgdir);
 		} else {
 			char *homedir = getenv("HOME");
 			if (homedir == NULL) {
@@ -497,7 +1660,7 @@ static char *effect_custom_compile(const char *path) {
 			}
 
 			cachepath = malloc(strlen(homedir) + strlen("/.cache/waylogout") + 1);
-			cachelen = sprintf(cachepath, "%s/.cache/waylogout", homedir);
+			sprintf(cachepath, "%s/.cache/waylogout", homedir);
 		}
 
 		if (mkdir(cachepath, 0777) < 0 && errno != EEXIST) {
@@ -510,77 +1673,353 @@ static char *effect_custom_compile(const char *path) {
 		}
 	}
 
-	// Find the true, absolute path of the input file
-	char *abspath = realpath(path, NULL);
-	size_t abspathlen = strlen(abspath);
-
-	char *outpath = malloc(cachelen + 1 + abspathlen + 3 + 1);
-	size_t outlen = sprintf(outpath, "%s/%s.so", cachepath, abspath);
+	return cachepath;
+}
 
-	// Sanitize
-	for (char *ch = outpath + cachelen + 1; ch < outpath + cachelen + 1 + abspathlen; ++ch) {
-		if (!(
-				(*ch >= 'a' && *ch <= 'z') ||
-				(*ch >= 'A' && *ch <= 'Z') ||
-				(*ch >= '0' && *ch <= '9') ||
-				(*ch == '.'))) {
-			*ch = '_';
+// The compiler command line; the output and source paths are filled in
+#define COMPILE_ARG_OUTPUT 7
+#define COMPILE_ARG_SOURCE 8
+static const char *compile_argv[] = {
+	"cc", "-shared", "-g", "-O2", "-march=native", "-fopenmp",
+	"-o", NULL, NULL, "-lm", NULL,
+};
+
+// What -march=native turns into: the architecture, and on x86 the CPU model
+// and feature flags, or elsewhere the kernel's hardware capabilities. A cache
+// that moves to another machine must not hand it a plugin for another CPU.
+static uint64_t effect_host_cpu_hash(uint64_t hash) {
+	struct utsname name;
+	if (uname(&name) == 0) {
+		hash = fnv1a_string(hash, name.machine);
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int leaves[][2] = {{0, 0}, {1, 0}, {7, 0}, {7, 1}, {0x80000001, 0}};
+	for (size_t i = 0; i < sizeof(leaves) / sizeof(*leaves); ++i) {
+		unsigned int regs[4] = {0};
+		__get_cpuid_count(leaves[i][0], leaves[i][1],
+				&regs[0], &regs[1], &regs[2], &regs[3]);
+		if (leaves[i][0] == 1) {
+			regs[0] &= ~0xfu; // the stepping doesn't change the code
+			regs[1] &= 0xffff; // nor which CPU this runs on
 		}
+		hash = fnv1a(hash, regs, sizeof(regs));
+	}
+#elif defined(__linux__)
+	unsigned long hwcap[] = {
+		getauxval(AT_HWCAP),
+#ifdef AT_HWCAP2
+		getauxval(AT_HWCAP2),
+#endif
+	};
+	hash = fnv1a(hash, hwcap, sizeof(hwcap));
+#endif
+	return hash;
+}
+
+// Compiled C plugins are named after a hash of their source, the compiler
+// command line, the plugin ABI and the host CPU, so that touching or moving
+// the source doesn't cause a rebuild, but changing any of those does.
+static bool effect_source_hash(const char *path, uint64_t *hash) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		waylogout_log(LOG_ERROR, "Custom effect: %s: %s", path, strerror(errno));
+		return false;
 	}
 
-	if (!file_is_outdated(path, outpath)) {
-		free(abspath);
-		return outpath;
+	*hash = FNV_OFFSET_BASIS;
+	char buf[4096];
+	size_t len;
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+		*hash = fnv1a(*hash, buf, len);
 	}
+	bool ok = !ferror(f);
+	fclose(f);
 
-	static const char *fmt = "cc -shared -g -O2 -march=native -fopenmp -o '%s' '%s' -lm";
-	char *cmd = malloc(strlen(fmt) + outlen - 2 + abspathlen - 2 + 1);
-	sprintf(cmd, fmt, outpath, abspath);
-	free(abspath);
-	fprintf(stderr, "Compiling custom effect: %s\n", cmd);
+	for (const char **arg = compile_argv; arg < compile_argv + COMPILE_ARG_OUTPUT; ++arg) {
+		*hash = fnv1a_string(*hash, *arg);
+	}
+	*hash = fnv1a_string(*hash, compile_argv[COMPILE_ARG_SOURCE + 1]);
+	int abi = WAYLOGOUT_EFFECT_ABI_VERSION;
+	*hash = fnv1a(*hash, &abi, sizeof(abi));
+	*hash = effect_host_cpu_hash(*hash);
+	return ok;
+}
+
+// Opens the compiled plugin if it's in the cache, or otherwise starts
+// compiling it in the background; see plugins_finish_compiling.
+static bool effect_custom_compile(struct waylogout_plugin *plugin, const char *path) {
+	const char *cachepath = effect_cache_dir();
+	uint64_t hash;
+	if (cachepath == NULL || !effect_source_hash(path, &hash)) {
+		return false;
+	}
+
+	char *outpath = malloc(strlen(cachepath) + 1 + 16 + strlen(".so") + 1);
+	sprintf(outpath, "%s/%016" PRIx64 ".so", cachepath, hash);
+	if (access(outpath, F_OK) == 0) {
+		bool ok = plugin_open(plugin, outpath);
+		free(outpath);
+		return ok;
+	}
+
+	// Compiled to a temporary file first, so that another waylogout never
+	// finds a half-written plugin. Each compile gets its own, even for two
+	// plugins with the same source.
+	char *tmppath = malloc(strlen(outpath) + strlen(".XXXXXX") + 1);
+	sprintf(tmppath, "%s.XXXXXX", outpath);
+	int tmpfd = mkstemp(tmppath);
+	if (tmpfd < 0) {
+		waylogout_log(LOG_ERROR, "Custom effect: mkstemp(%s): %s",
+				tmppath, strerror(errno));
+		free(tmppath);
+		free(outpath);
+		return false;
+	}
+	fchmod(tmpfd, 0644); // mkstemp's 0600 would keep the cache private
+	close(tmpfd);
 
-	// Finally, compile.
-	int ret = system(cmd);
-	free(cmd);
+	const char *argv[sizeof(compile_argv) / sizeof(*compile_argv)];
+	memcpy(argv, compile_argv, sizeof(argv));
+	argv[COMPILE_ARG_OUTPUT] = tmppath;
+	argv[COMPILE_ARG_SOURCE] = path;
+
+	fprintf(stderr, "Compiling custom effect:");
+	for (const char **arg = argv; *arg; ++arg) {
+		fprintf(stderr, " %s", *arg);
+	}
+	fprintf(stderr, "\n");
+
+	int ret = posix_spawnp(&plugin->compiler, argv[0], NULL, NULL,
+			(char *const *)argv, environ);
 	if (ret != 0) {
-		if (ret == -1) {
-			waylogout_log(LOG_ERROR, "Custom effect: system(): %s", strerror(errno));
-			free(outpath);
-			return NULL;
-		} else {
-			waylogout_log(LOG_ERROR, "Custom effect compilation failed\n");
-			free(outpath);
-			return NULL;
-		}
+		waylogout_log(LOG_ERROR, "Custom effect: posix_spawnp(): %s", strerror(ret));
+		plugin->compiler = 0;
+		unlink(tmppath);
+		free(tmppath);
+		free(outpath);
+		return false;
+	}
+
+	plugin->compiling_path = tmppath;
+	plugin->compiled_path = outpath;
+	return true;
+}
+
+static bool plugin_finish_compiling(struct waylogout_plugin *plugin) {
+	int status;
+	pid_t ret;
+	do {
+		ret = waitpid(plugin->compiler, &status, 0);
+	} while (ret < 0 && errno == EINTR);
+	plugin->compiler = 0;
+
+	bool ok = false;
+	if (ret < 0) {
+		waylogout_log(LOG_ERROR, "Custom effect: waitpid(): %s", strerror(errno));
+	} else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		waylogout_log(LOG_ERROR, "Custom effect compilation failed: %s", plugin->path);
+	} else if (rename(plugin->compiling_path, plugin->compiled_path) < 0) {
+		waylogout_log(LOG_ERROR, "Custom effect: rename %s: %s",
+				plugin->compiling_path, strerror(errno));
+	} else {
+		ok = plugin_open(plugin, plugin->compiled_path);
 	}
 
-	return outpath;
+	unlink(plugin->compiling_path);
+	free(plugin->compiling_path);
+	free(plugin->compiled_path);
+	plugin->compiling_path = plugin->compiled_path = NULL;
+	return ok;
+}
+
+bool waylogout_plugins_wait(void) {
+	// Effect chains for several images may be waiting at once
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+	bool ok = true;
+	pthread_mutex_lock(&lock);
+	for (struct waylogout_plugin *plugin = plugins; plugin; plugin = plugin->next) {
+		if (plugin->compiler > 0) {
+			plugin_finish_compiling(plugin);
+		}
+		ok = ok && plugin->dl != NULL;
+	}
+	pthread_mutex_unlock(&lock);
+	return ok;
 }
 
-static void effect_custom(uint32_t *data, int width, int height, int scale,
-		char *path) {
+struct waylogout_plugin *waylogout_plugin_load(const char *path) {
+	for (struct waylogout_plugin *plugin = plugins; plugin; plugin = plugin->next) {
+		if (strcmp(plugin->path, path) == 0) {
+			return plugin;
+		}
+	}
+
+	struct waylogout_plugin *plugin = calloc(1, sizeof(*plugin));
+	bool ok = false;
 	size_t pathlen = strlen(path);
 	if (pathlen > 3 && strcmp(path + pathlen - 3, ".so") == 0) {
-		effect_custom_run(data, width, height, scale, path);
+		ok = plugin_open(plugin, path);
 	} else if (pathlen > 2 && strcmp(path + pathlen - 2, ".c") == 0) {
-		char *compiled = effect_custom_compile(path);
-		if (compiled != NULL) {
-			effect_custom_run(data, width, height, scale, compiled);
-			free(compiled);
-		}
+		ok = effect_custom_compile(plugin, path);
 	} else {
 		waylogout_log(
 			LOG_ERROR, "%s: Unknown file type for custom effect (expected .c or .so)",
 			path);
 	}
+
+	if (!ok) {
+		free(plugin);
+		return NULL;
+	}
+
+	plugin->path = strdup(path);
+	plugin->next = plugins;
+	plugins = plugin;
+	return plugin;
+}
+
+void waylogout_plugins_unload(void) {
+	while (plugins) {
+		struct waylogout_plugin *plugin = plugins;
+		plugins = plugin->next;
+		if (plugin->compiler > 0) {
+			plugin_finish_compiling(plugin);
+		}
+		if (plugin->dl) {
+			dlclose(plugin->dl);
+		}
+		free(plugin->path);
+		free(plugin);
+	}
+}
+
+// Point-wise effects compute every pixel from nothing but that pixel and its
+// position, so a run of them can go through the image in a single pass.
+struct pixel_op {
+	enum {
+		PIXEL_OP_GREYSCALE,
+		PIXEL_OP_VIGNETTE,
+		PIXEL_OP_CUSTOM,
+		PIXEL_OP_ROWS,
+	} type;
+	double base, factor;
+	uint32_t (*pixel_func)(uint32_t pix, int x, int y, int width, int height);
+	struct waylogout_plugin *plugin;
+	void *state;
+};
+
+static bool pixel_op_from_effect(struct pixel_op *op, struct waylogout_effect *effect) {
+	switch (effect->tag) {
+	case EFFECT_GREYSCALE:
+		op->type = PIXEL_OP_GREYSCALE;
+		return true;
+	case EFFECT_VIGNETTE:
+		op->type = PIXEL_OP_VIGNETTE;
+		op->base = fmin(1, fmax(0, effect->e.vignette.base));
+		op->factor = fmin(1 - op->base, fmax(0, effect->e.vignette.factor));
+		return true;
+	case EFFECT_CUSTOM:
+		if (effect->e.custom.plugin->dl == NULL) {
+			return false;
+		}
+
+		// Version 2 plugins without a halo only need their own rows,
+		// so they can run one row at a time along with the others.
+		if (effect->e.custom.plugin->rows_func != NULL &&
+				effect->e.custom.plugin->halo == 0) {
+			op->type = PIXEL_OP_ROWS;
+			op->plugin = effect->e.custom.plugin;
+			return true;
+		}
+		if (effect->e.custom.plugin->pixel_func == NULL) {
+			return false;
+		}
+		op->type = PIXEL_OP_CUSTOM;
+		op->pixel_func = effect->e.custom.plugin->pixel_func;
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Fills 'ops' with the run of point-wise effects at the start of 'effects',
+// and returns its length.
+static int pixel_ops_collect(struct pixel_op *ops,
+		struct waylogout_effect *effects, int count) {
+	int n = 0;
+	while (n < count && pixel_op_from_effect(&ops[n], &effects[n])) {
+		n += 1;
+	}
+	return n;
+}
+
+// The image is processed one row at a time, with every effect going over the
+// row before the next one starts. A row fits in the L1 cache, so the image
+// is still only read and written once, while each effect's loop stays simple
+// enough for the compiler to vectorize.
+static void effect_pixel_ops(struct effect_image image, int scale,
+		const struct pixel_op *ops, int count) {
+	int width = image.width, height = image.height;
+
+#pragma omp parallel for
+	for (int y = 0; y < height; ++y) {
+		uint32_t *row = image.data + y * image.stride;
+		for (int i = 0; i < count; ++i) {
+			const struct pixel_op *op = &ops[i];
+			switch (op->type) {
+			case PIXEL_OP_GREYSCALE:
+				for (int x = 0; x < width; ++x) {
+					row[x] = greyscale_pixel(row[x]);
+				}
+				break;
+			case PIXEL_OP_VIGNETTE:
+				for (int x = 0; x < width; ++x) {
+					row[x] = vignette_pixel(row[x], x, y, width, height,
+							op->base, op->factor);
+				}
+				break;
+			case PIXEL_OP_CUSTOM:
+				for (int x = 0; x < width; ++x) {
+					row[x] = op->pixel_func(row[x], x, y, width, height);
+				}
+				break;
+			case PIXEL_OP_ROWS:
+				op->plugin->rows_func(image.data, image.stride, y, y + 1,
+						width, height, scale, op->state);
+				break;
+			}
+		}
+	}
 }
 
+static cairo_surface_t *run_pixel_ops(cairo_surface_t *surface, int scale,
+		struct pixel_op *ops, int count) {
+	int width = cairo_image_surface_get_width(surface);
+	int height = cairo_image_surface_get_height(surface);
+	for (int i = 0; i < count; ++i) {
+		if (ops[i].type == PIXEL_OP_ROWS) {
+			ops[i].state = plugin_init(ops[i].plugin, width, height, scale);
+		}
+	}
+
+	effect_pixel_ops(effect_image_of(surface), scale, ops, count);
+	cairo_surface_flush(surface);
+
+	for (int i = 0; i < count; ++i) {
+		if (ops[i].type == PIXEL_OP_ROWS) {
+			plugin_teardown(ops[i].plugin, ops[i].state);
+		}
+	}
+	return surface;
+}
+
+// Point-wise effects don't go through here; see run_pixel_ops.
 static cairo_surface_t *run_effect(cairo_surface_t *surface, int scale,
 		struct waylogout_effect *effect) {
 	switch (effect->tag) {
 	case EFFECT_BLUR: {
-		cairo_surface_t *surf = cairo_image_surface_create(
-				CAIRO_FORMAT_RGB24,
+		cairo_surface_t *surf = arena_surface_create(
 				cairo_image_surface_get_width(surface),
 				cairo_image_surface_get_height(surface));
 
@@ -590,12 +2029,7 @@ static cairo_surface_t *run_effect(cairo_surface_t *surface, int scale,
 			break;
 		}
 
-		effect_blur(
-				(uint32_t *)cairo_image_surface_get_data(surf),
-				(uint32_t *)cairo_image_surface_get_data(surface),
-				cairo_image_surface_get_width(surface),
-				cairo_image_surface_get_height(surface),
-				scale,
+		effect_blur(effect_image_of(surf), effect_image_of(surface), scale,
 				effect->e.blur.radius, effect->e.blur.times);
 		cairo_surface_flush(surf);
 		cairo_surface_destroy(surface);
@@ -603,67 +2037,74 @@ static cairo_surface_t *run_effect(cairo_surface_t *surface, int scale,
 		break;
 	}
 
-	case EFFECT_PIXELATE: {
-		effect_pixelate(
-				(uint32_t *)cairo_image_surface_get_data(surface),
+	case EFFECT_GAUSSIAN: {
+		cairo_surface_t *surf = arena_surface_create(
 				cairo_image_surface_get_width(surface),
-				cairo_image_surface_get_height(surface),
-				scale,
-				effect->e.pixelate.factor);
-		cairo_surface_flush(surface);
+				cairo_image_surface_get_height(surface));
+
+		if (cairo_surface_status(surf) != CAIRO_STATUS_SUCCESS) {
+			waylogout_log(LOG_ERROR, "Failed to create surface for gaussian effect");
+			cairo_surface_destroy(surf);
+			break;
+		}
+
+		effect_gaussian(effect_image_of(surf), effect_image_of(surface), scale,
+				effect->e.gaussian.sigma);
+		cairo_surface_flush(surf);
+		cairo_surface_destroy(surface);
+		surface = surf;
 		break;
 	}
 
-	case EFFECT_SCALE: {
-		cairo_surface_t *surf = cairo_image_surface_create(
-				CAIRO_FORMAT_RGB24,
-				cairo_image_surface_get_width(surface) * effect->e.scale,
-				cairo_image_surface_get_height(surface) * effect->e.scale);
+	case EFFECT_KAWASE: {
+		cairo_surface_t *surf = arena_surface_create(
+				cairo_image_surface_get_width(surface),
+				cairo_image_surface_get_height(surface));
 
 		if (cairo_surface_status(surf) != CAIRO_STATUS_SUCCESS) {
-			waylogout_log(LOG_ERROR, "Failed to create surface for scale effect");
+			waylogout_log(LOG_ERROR, "Failed to create surface for kawase effect");
 			cairo_surface_destroy(surf);
 			break;
 		}
 
-		effect_scale(
-				(uint32_t *)cairo_image_surface_get_data(surf),
-				(uint32_t *)cairo_image_surface_get_data(surface),
-				cairo_image_surface_get_width(surface),
-				cairo_image_surface_get_height(surface),
-				effect->e.scale);
+		effect_kawase(effect_image_of(surf), effect_image_of(surface), scale,
+				effect->e.kawase.radius, effect->e.kawase.times);
 		cairo_surface_flush(surf);
 		cairo_surface_destroy(surface);
 		surface = surf;
 		break;
 	}
 
-	case EFFECT_GREYSCALE: {
-		effect_greyscale(
-				(uint32_t *)cairo_image_surface_get_data(surface),
-				cairo_image_surface_get_width(surface),
-				cairo_image_surface_get_height(surface));
+	case EFFECT_PIXELATE: {
+		effect_pixelate(effect_image_of(surface), scale, effect->e.pixelate.factor);
 		cairo_surface_flush(surface);
 		break;
 	}
 
-	case EFFECT_VIGNETTE: {
-		effect_vignette(
-				(uint32_t *)cairo_image_surface_get_data(surface),
-				cairo_image_surface_get_width(surface),
-				cairo_image_surface_get_height(surface),
-				effect->e.vignette.base,
-				effect->e.vignette.factor);
-		cairo_surface_flush(surface);
+	case EFFECT_SCALE: {
+		cairo_surface_t *surf = arena_surface_create(
+				cairo_image_surface_get_width(surface) * effect->e.scale,
+				cairo_image_surface_get_height(surface) * effect->e.scale);
+
+		if (cairo_surface_status(surf) != CAIRO_STATUS_SUCCESS) {
+			waylogout_log(LOG_ERROR, "Failed to create surface for scale effect");
+			cairo_surface_destroy(surf);
+			break;
+		}
+
+		effect_scale(effect_image_of(surf), effect_image_of(surface), effect->e.scale);
+		cairo_surface_flush(surf);
+		cairo_surface_destroy(surface);
+		surface = surf;
 		break;
 	}
 
+	case EFFECT_GREYSCALE:
+	case EFFECT_VIGNETTE:
+		break;
+
 	case EFFECT_COMPOSE: {
-		effect_compose(
-				(uint32_t *)cairo_image_surface_get_data(surface),
-				cairo_image_surface_get_width(surface),
-				cairo_image_surface_get_height(surface),
-				scale,
+		effect_compose(effect_image_of(surface), scale,
 				effect->e.compose.x, effect->e.compose.y,
 				effect->e.compose.w, effect->e.compose.h,
 				effect->e.compose.gravity, effect->e.compose.imgpath);
@@ -672,12 +2113,15 @@ static cairo_surface_t *run_effect(cairo_surface_t *surface, int scale,
 	}
 
 	case EFFECT_CUSTOM: {
-		effect_custom(
-				(uint32_t *)cairo_image_surface_get_data(surface),
-				cairo_image_surface_get_width(surface),
-				cairo_image_surface_get_height(surface),
-				scale,
-				effect->e.custom);
+		struct waylogout_plugin *plugin = effect->e.custom.plugin;
+		if (plugin->dl == NULL) {
+			// It failed to compile
+			break;
+		} else if (plugin->rows_func) {
+			plugin_run_rows(plugin, effect_image_of(surface), scale);
+		} else {
+			plugin_run_v1(plugin, effect_image_of(surface), scale);
+		}
 		cairo_surface_flush(surface);
 		break;
 	} }
@@ -685,73 +2129,467 @@ static cairo_surface_t *run_effect(cairo_surface_t *surface, int scale,
 	return surface;
 }
 
+static const cairo_user_data_key_t view_key;
+
+static void view_destroy(void *data) {
+	cairo_surface_destroy(data);
+}
+
+// Makes the surface into one the effects can work on. An RGB24 surface is
+// used as it is, and an ARGB32 one is viewed as RGB24 without copying it,
+// since the effects never read the alpha byte. The view keeps the original
+// surface alive. Anything else is converted.
 static cairo_surface_t *ensure_format(cairo_surface_t *surface) {
-	if (cairo_image_surface_get_format(surface) == CAIRO_FORMAT_RGB24) {
+	cairo_format_t format = cairo_image_surface_get_format(surface);
+	if (format == CAIRO_FORMAT_RGB24) {
 		return surface;
 	}
 
+	int width = cairo_image_surface_get_width(surface);
+	int height = cairo_image_surface_get_height(surface);
+	cairo_surface_flush(surface);
+
+	if (format == CAIRO_FORMAT_ARGB32) {
+		cairo_surface_t *view = cairo_image_surface_create_for_data(
+				cairo_image_surface_get_data(surface), CAIRO_FORMAT_RGB24,
+				width, height, cairo_image_surface_get_stride(surface));
+		if (cairo_surface_status(view) == CAIRO_STATUS_SUCCESS &&
+				cairo_surface_set_user_data(view, &view_key,
+					surface, view_destroy) == CAIRO_STATUS_SUCCESS) {
+			return view;
+		}
+		cairo_surface_destroy(view);
+	}
+
 	waylogout_log(LOG_DEBUG, "Have to convert surface to CAIRO_FORMAT_RGB24 from %i.",
-			(int)cairo_image_surface_get_format(surface));
+			(int)format);
 
-	cairo_surface_t *surf = cairo_image_surface_create(
-			CAIRO_FORMAT_RGB24,
-			cairo_image_surface_get_width(surface),
-			cairo_image_surface_get_height(surface));
+	cairo_surface_t *surf = arena_surface_create(width, height);
 	if (cairo_surface_status(surf) != CAIRO_STATUS_SUCCESS) {
-		waylogout_log(LOG_ERROR, "Failed to create surface for scale effect");
+		waylogout_log(LOG_ERROR, "Failed to create surface for effects");
 		cairo_surface_destroy(surf);
 		return NULL;
 	}
 
-	memcpy(
-			cairo_image_surface_get_data(surf),
-			cairo_image_surface_get_data(surface),
-			cairo_image_surface_get_stride(surface) * cairo_image_surface_get_height(surface));
+	cairo_t *cairo = cairo_create(surf);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_surface(cairo, surface, 0, 0);
+	cairo_paint(cairo);
+	cairo_destroy(cairo);
+	cairo_surface_flush(surf);
 	cairo_surface_destroy(surface);
 	return surf;
 }
 
+// Rough cost of each effect in nanoseconds per pixel on one core. They only
+// need to be good enough to tell a cheap plan from an expensive one.
+#define COST_BLUR_SIMD 15.0 // per pass
+#define COST_BLUR_SCALAR 31.0 // per pass
+#define COST_GAUSSIAN 30.0
+#define COST_KAWASE 18.0
+#define COST_PIXELATE 2.0
+#define COST_SCALE 2.0 // per destination pixel
+#define COST_GREYSCALE 4.0
+#define COST_VIGNETTE 7.5
+#define COST_COMPOSE 10.0
+#define COST_CUSTOM 5.0
+
+static double effect_cost_ms(struct waylogout_effect *effect,
+		int width, int height, int scale) {
+	double pixels = (double)width * height;
+	double ns;
+	switch (effect->tag) {
+	case EFFECT_BLUR: {
+		int radius = effect->e.blur.radius * scale;
+		bool simd = blur_kernel_select(width, height, radius) != &blur_kernel_scalar;
+		ns = (simd ? COST_BLUR_SIMD : COST_BLUR_SCALAR) * effect->e.blur.times;
+		break;
+	}
+	case EFFECT_GAUSSIAN: ns = COST_GAUSSIAN; break;
+	case EFFECT_KAWASE: ns = COST_KAWASE; break;
+	case EFFECT_PIXELATE: ns = COST_PIXELATE; break;
+	case EFFECT_SCALE: ns = COST_SCALE * effect->e.scale * effect->e.scale; break;
+	case EFFECT_GREYSCALE: ns = COST_GREYSCALE; break;
+	case EFFECT_VIGNETTE: ns = COST_VIGNETTE; break;
+	case EFFECT_COMPOSE: ns = COST_COMPOSE; break;
+	case EFFECT_CUSTOM: ns = COST_CUSTOM; break;
+	default: abort();
+	}
+
+	return ns * pixels / 1000000.0 / omp_get_max_threads();
+}
+
+// The size of the image after running 'effect' on a width x height image.
+static void effect_output_size(struct waylogout_effect *effect, int *width, int *height) {
+	if (effect->tag == EFFECT_SCALE) {
+		*width = *width * effect->e.scale;
+		*height = *height * effect->e.scale;
+	}
+}
+
+static double effects_cost_ms(struct waylogout_effect *effects, int count,
+		int width, int height, int scale) {
+	double ms = 0;
+	for (int i = 0; i < count; ++i) {
+		ms += effect_cost_ms(&effects[i], width, height, scale);
+		effect_output_size(&effects[i], &width, &height);
+	}
+	return ms;
+}
+
+// Whether a compose effect replaces every pixel of a width x height image:
+// the image has to be stretched to cover it exactly, and be in a format
+// which can't have an alpha channel.
+static bool compose_is_opaque_cover(struct waylogout_effect *effect,
+		int width, int height, int scale) {
+#if !HAVE_GDK_PIXBUF
+	return false;
+#else
+	int imgw = screen_size_to_pix(effect->e.compose.w, width, scale);
+	int imgh = screen_size_to_pix(effect->e.compose.h, height, scale);
+	if (imgw != width || imgh != height) {
+		return false;
+	}
+
+	int imgx, imgy;
+	screen_pos_pair_to_pix(
+			effect->e.compose.x, effect->e.compose.y, imgw, imgh,
+			width, height, scale, effect->e.compose.gravity,
+			&imgx, &imgy);
+	if (imgx != 0 || imgy != 0) {
+		return false;
+	}
+
+	GdkPixbufFormat *format = gdk_pixbuf_get_file_info(effect->e.compose.imgpath, NULL, NULL);
+	if (format == NULL) {
+		return false;
+	}
+
+	gchar *name = gdk_pixbuf_format_get_name(format);
+	bool opaque = strcmp(name, "jpeg") == 0;
+	g_free(name);
+	return opaque;
+#endif
+}
+
+static bool effect_is_blur(struct waylogout_effect *effect) {
+	return effect->tag == EFFECT_BLUR ||
+		effect->tag == EFFECT_GAUSSIAN ||
+		effect->tag == EFFECT_KAWASE;
+}
+
+// Makes a blur that runs on an image scaled by 'factor' look like the
+// original blur did on the unscaled image.
+static void blur_rescale(struct waylogout_effect *effect, double factor) {
+	switch (effect->tag) {
+	case EFFECT_BLUR:
+		effect->e.blur.radius = fmax(1, round(effect->e.blur.radius * factor));
+		break;
+	case EFFECT_GAUSSIAN:
+		effect->e.gaussian.sigma *= factor;
+		break;
+	case EFFECT_KAWASE:
+		effect->e.kawase.radius = fmax(1, round(effect->e.kawase.radius * factor));
+		break;
+	default:
+		abort();
+	}
+}
+
+static void effects_remove(struct waylogout_effect *effects, int *count, int index) {
+	memmove(&effects[index], &effects[index + 1],
+			(*count - index - 1) * sizeof(*effects));
+	*count -= 1;
+}
+
+// Rewrites the effect chain into a cheaper one which gives the same result,
+// or very nearly so. 'plan' needs room for 'count' effects; the effects in it
+// share their strings with the ones in 'effects'. Returns the number of
+// effects in the plan.
+static int effects_plan(struct waylogout_effect *plan,
+		struct waylogout_effect *effects, int count,
+		int width, int height, int scale) {
+	memcpy(plan, effects, count * sizeof(*plan));
+
+	// Everything before an opaque compose covering the whole image is
+	// invisible, except for scales, which decide the size it's composed at.
+	int w = width, h = height;
+	for (int i = 0; i < count; ++i) {
+		if (plan[i].tag == EFFECT_COMPOSE && compose_is_opaque_cover(&plan[i], w, h, scale)) {
+			for (int j = i - 1; j >= 0; --j) {
+				if (plan[j].tag != EFFECT_SCALE) {
+					effects_remove(plan, &count, j);
+					i -= 1;
+				}
+			}
+		}
+		effect_output_size(&plan[i], &w, &h);
+	}
+
+	bool changed;
+	do {
+		changed = false;
+		for (int i = 0; i + 1 < count; ++i) {
+			struct waylogout_effect *a = &plan[i], *b = &plan[i + 1];
+
+			// Two shrinks or two grows in a row are one scale. A shrink
+			// and a grow are not: with nearest-neighbour scaling, shrinking
+			// then growing back pixelates the image.
+			if (a->tag == EFFECT_SCALE && b->tag == EFFECT_SCALE &&
+					((a->e.scale < 1 && b->e.scale < 1) ||
+					(a->e.scale > 1 && b->e.scale > 1))) {
+				a->e.scale *= b->e.scale;
+				effects_remove(plan, &count, i + 1);
+				changed = true;
+				break;
+			}
+
+			// Shrinking first means blurring or greyscaling fewer pixels.
+			// Greyscale commutes with the nearest-neighbour scale exactly,
+			// a blur with its radius shrunk along with the image almost does.
+			if (b->tag == EFFECT_SCALE && b->e.scale < 1 &&
+					(effect_is_blur(a) || a->tag == EFFECT_GREYSCALE)) {
+				struct waylogout_effect moved = *a;
+				if (effect_is_blur(&moved)) {
+					blur_rescale(&moved, b->e.scale);
+				}
+				*a = *b;
+				*b = moved;
+				changed = true;
+				break;
+			}
+		}
+	} while (changed);
+
+	// A scale by 1 is a copy. Merging never makes one, so these are all
+	// the user's own.
+	for (int i = 0; i < count; ++i) {
+		if (plan[i].tag == EFFECT_SCALE && plan[i].e.scale == 1) {
+			effects_remove(plan, &count, i--);
+		}
+	}
+
+	return count;
+}
+
+// Reserves the buffers a plan will need in one go, all large enough for its
+// largest image: two to ping-pong between, and scratch space for the blurs
+static void effects_reserve(struct waylogout_effect *effects, int count,
+		int width, int height) {
+	size_t largest = (size_t)width * height * sizeof(uint32_t);
+	int surfaces = 0;
+	bool scratch = false;
+	for (int i = 0; i < count; ++i) {
+		effect_output_size(&effects[i], &width, &height);
+		size_t size = (size_t)width * height * sizeof(uint32_t);
+		largest = size > largest ? size : largest;
+
+		switch (effects[i].tag) {
+		case EFFECT_BLUR:
+		case EFFECT_GAUSSIAN:
+		case EFFECT_KAWASE:
+			scratch = true;
+			surfaces += 1;
+			break;
+		case EFFECT_SCALE:
+			surfaces += 1;
+			break;
+		default:
+			break;
+		}
+	}
+
+	arena_reserve(largest, (surfaces < 2 ? surfaces : 2) + scratch);
+}
+
+static void effect_print(struct waylogout_effect *effect) {
+	switch (effect->tag) {
+	case EFFECT_BLUR:
+		fprintf(stderr, "blur %dx%d", effect->e.blur.radius, effect->e.blur.times);
+		break;
+	case EFFECT_GAUSSIAN:
+		fprintf(stderr, "gaussian %g", effect->e.gaussian.sigma);
+		break;
+	case EFFECT_KAWASE:
+		fprintf(stderr, "kawase %dx%d", effect->e.kawase.radius, effect->e.kawase.times);
+		break;
+	case EFFECT_SCALE:
+		fprintf(stderr, "scale %g", effect->e.scale);
+		break;
+	default:
+		fprintf(stderr, "%s", effect_name(effect));
+		break;
+	}
+}
+
 cairo_surface_t *waylogout_effects_run(cairo_surface_t *surface, int scale,
 		struct waylogout_effect *effects, int count) {
 	surface = ensure_format(surface);
 	if (surface == NULL) return NULL;
 
-	for (int i = 0; i < count; ++i) {
-		struct waylogout_effect *effect = &effects[i];
-		surface = run_effect(surface, scale, effect);
+	waylogout_plugins_wait();
+
+	struct waylogout_effect *plan = malloc(count * sizeof(*plan));
+	count = effects_plan(plan, effects, count,
+			cairo_image_surface_get_width(surface),
+			cairo_image_surface_get_height(surface), scale);
+	effects = plan;
+	effects_reserve(effects, count,
+			cairo_image_surface_get_width(surface),
+			cairo_image_surface_get_height(surface));
+
+	struct pixel_op *ops = malloc(count * sizeof(*ops));
+
+	for (int i = 0; i < count;) {
+		int n = pixel_ops_collect(ops, &effects[i], count - i);
+		if (n > 0) {
+			surface = run_pixel_ops(surface, scale, ops, n);
+			i += n;
+		} else {
+			surface = run_effect(surface, scale, &effects[i]);
+			i += 1;
+		}
 	}
 
+	free(ops);
+	free(plan);
 	return surface;
 }
 
 #define TIME_MSEC(tv) ((tv).tv_sec * 1000.0 + (tv).tv_nsec / 1000000.0)
 #define TIME_DELTA(first, last) (TIME_MSEC(last) - TIME_MSEC(first))
 
+// Runs one blur pass over the image with both the selected kernel and the
+// scalar kernel, so that --time-effects shows what the SIMD kernels buy us.
+// Returns how long that took, which isn't part of running the effects.
+static double blur_report_speedup(struct effect_image image, int radius) {
+	int width = image.width, height = image.height;
+	const struct blur_kernel *kernel = blur_kernel_select(width, height, radius);
+	if (kernel == &blur_kernel_scalar) {
+		fprintf(stderr, "        kernel: %s\n", kernel->name);
+		return 0;
+	}
+
+	struct timespec report_tv, start_tv, mid_tv, end_tv;
+	clock_gettime(CLOCK_MONOTONIC, &report_tv);
+
+	// Nor do its buffers count towards what the effects used
+	size_t peak = arena_peak;
+	size_t size = (size_t)width * height * sizeof(uint32_t);
+	struct arena_buffer *dest = arena_get(size);
+	struct arena_buffer *scratch = arena_get(size);
+	if (dest == NULL || scratch == NULL) {
+		if (dest) {
+			arena_put(dest);
+		}
+		if (scratch) {
+			arena_put(scratch);
+		}
+		arena_peak = peak;
+		fprintf(stderr, "        kernel: %s\n", kernel->name);
+		clock_gettime(CLOCK_MONOTONIC, &end_tv);
+		return TIME_DELTA(report_tv, end_tv);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start_tv);
+	uint32_t *recip = blur_kernel_reciprocals(&kernel, width, height, radius);
+	blur_once(kernel, recip, dest->data, width, image.data, image.stride,
+			scratch->data, width, height, radius);
+	clock_gettime(CLOCK_MONOTONIC, &mid_tv);
+	blur_once(&blur_kernel_scalar, NULL, dest->data, width, image.data, image.stride,
+			scratch->data, width, height, radius);
+	clock_gettime(CLOCK_MONOTONIC, &end_tv);
+
+	free(recip);
+	arena_put(scratch);
+	arena_put(dest);
+	arena_peak = peak;
+
+	double simd_ms = TIME_DELTA(start_tv, mid_tv);
+	double scalar_ms = TIME_DELTA(mid_tv, end_tv);
+	fprintf(stderr, "        kernel: %s, %fms per pass (scalar: %fms, %.1fx)\n",
+			kernel->name, simd_ms, scalar_ms, scalar_ms / simd_ms);
+	clock_gettime(CLOCK_MONOTONIC, &end_tv);
+	return TIME_DELTA(report_tv, end_tv);
+}
+
 cairo_surface_t *waylogout_effects_run_timed(cairo_surface_t *surface, int scale,
 		struct waylogout_effect *effects, int count) {
 	struct timespec start_tv;
 	clock_gettime(CLOCK_MONOTONIC, &start_tv);
+	arena_in_use = 0;
+	arena_peak = 0;
 
 	surface = ensure_format(surface);
 	if (surface == NULL) return NULL;
 
+	waylogout_plugins_wait();
+
+	int width = cairo_image_surface_get_width(surface);
+	int height = cairo_image_surface_get_height(surface);
+	struct waylogout_effect *plan = malloc(count * sizeof(*plan));
+	int plan_count = effects_plan(plan, effects, count, width, height, scale);
+
+	fprintf(stderr, "Planned %i effects as %i (predicted %fms instead of %fms):\n",
+			count, plan_count,
+			effects_cost_ms(plan, plan_count, width, height, scale),
+			effects_cost_ms(effects, count, width, height, scale));
+	for (int i = 0; i < plan_count; ++i) {
+		fprintf(stderr, "    ");
+		effect_print(&plan[i]);
+		fprintf(stderr, "\n");
+	}
+	effects = plan;
+	count = plan_count;
+	effects_reserve(effects, count, width, height);
+
+	struct pixel_op *ops = malloc(count * sizeof(*ops));
+	double report_ms = 0;
+
 	fprintf(stderr, "Running %i effects:\n", count);
-	for (int i = 0; i < count; ++i) {
+	for (int i = 0; i < count;) {
 		struct timespec effect_start_tv;
 		clock_gettime(CLOCK_MONOTONIC, &effect_start_tv);
 
 		struct waylogout_effect *effect = &effects[i];
-		surface = run_effect(surface, scale, effect);
+		int n = pixel_ops_collect(ops, effect, count - i);
+		if (n > 0) {
+			surface = run_pixel_ops(surface, scale, ops, n);
+		} else {
+			surface = run_effect(surface, scale, effect);
+		}
 
 		struct timespec effect_end_tv;
 		clock_gettime(CLOCK_MONOTONIC, &effect_end_tv);
-		fprintf(stderr, "    %s: %fms\n", effect_name(effect),
-				TIME_DELTA(effect_start_tv, effect_end_tv));
+
+		n = n > 0 ? n : 1;
+		fprintf(stderr, "    %s", effect_name(effect));
+		for (int j = 1; j < n; ++j) {
+			fprintf(stderr, " + %s", effect_name(&effects[i + j]));
+		}
+		fprintf(stderr, "%s: %fms (predicted %fms)\n", n > 1 ? " (fused)" : "",
+				TIME_DELTA(effect_start_tv, effect_end_tv),
+				effects_cost_ms(effect, n, width, height, scale));
+		for (int j = 0; j < n; ++j) {
+			effect_output_size(&effects[i + j], &width, &height);
+		}
+		i += n;
+
+		if (effect->tag == EFFECT_BLUR) {
+			report_ms += blur_report_speedup(effect_image_of(surface),
+					effect->e.blur.radius * scale);
+		}
 	}
 
 	struct timespec end_tv;
 	clock_gettime(CLOCK_MONOTONIC, &end_tv);
-	fprintf(stderr, "Effects took %fms.\n", TIME_DELTA(start_tv, end_tv));
+	fprintf(stderr, "Effects took %fms.\n",
+			TIME_DELTA(start_tv, end_tv) - report_ms);
+	fprintf(stderr, "Effects used at most %.1fMiB of buffers.\n",
+			arena_peak / (1024.0 * 1024.0));
+
+	free(ops);
+	free(plan);
 
 	return surface;
 }
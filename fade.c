@@ -16,64 +16,231 @@ double get_time() {
 }
 #endif
 
-#if defined(USE_SSE) && defined(__SSE2__)
-#define set_alpha set_alpha_sse
+// A fade kernel draws 'count' pixels of a step of the fade. fade_set splits
+// the buffer into runs of rows, which the threads draw at the same time.
+struct fade_kernel {
+	const char *name;
+	void (*alpha)(uint32_t *dest, const uint32_t *orig, size_t count, float alpha);
+	void (*blend)(uint32_t *dest, const uint32_t *from, const uint32_t *orig,
+			size_t count, float alpha);
+};
 
+// The x86 kernels don't depend on -Dsse: SSE2 is there whenever __SSE2__
+// is, and the AVX2 kernels are only picked if the CPU has AVX2.
+#ifdef __SSE2__
 #include <immintrin.h>
 
-static void set_alpha_sse(uint32_t *orig, struct pool_buffer *buf, float alpha) {
+// The SIMD kernels scale each byte by alpha as a 0.16 fixed-point number,
+// (byte * alpha_factor) >> 16, the way _mm_mulhi_epu16 does.
+static uint16_t fade_alpha_factor(float alpha) {
 	int alpha_factor = (int)(alpha * (1 << 16));
 	if (alpha_factor != 0)
 		alpha_factor -= 1;
+	return alpha_factor;
+}
 
-	__m128i alpha_vec = _mm_set_epi16(
-			alpha_factor, alpha_factor, alpha_factor, alpha_factor,
-			alpha_factor, alpha_factor, alpha_factor, alpha_factor);
-	__m128i dummy_vec = _mm_set_epi16(0, 0, 0, 0, 0, 0, 0, 0);
+// The same as the SIMD kernels, for the pixels left over at the end
+static uint32_t fade_alpha_pixel(uint32_t pix, uint32_t alpha_factor) {
+	uint32_t dest = 0;
+	for (int shift = 0; shift < 32; shift += 8) {
+		dest |= ((((pix >> shift) & 0xff) * alpha_factor) >> 16) << shift;
+	}
+	return dest;
+}
 
-	uint8_t *orig_bytes = (uint8_t *)orig;
-	uint8_t *dest_bytes = (uint8_t *)buf->data;
-	size_t length = ((size_t)buf->width * (size_t)buf->height * 4) / 8;
+static uint32_t fade_blend_pixel(uint32_t from, uint32_t pix, uint32_t alpha_factor) {
+	uint32_t inv_alpha_factor = 0xffff - alpha_factor;
+	uint32_t dest = 0;
+	for (int shift = 0; shift < 32; shift += 8) {
+		uint32_t c = ((((from >> shift) & 0xff) * inv_alpha_factor) >> 16) +
+			((((pix >> shift) & 0xff) * alpha_factor) >> 16);
+		dest |= (c > 0xff ? 0xff : c) << shift;
+	}
+	return dest;
+}
 
-	for (size_t i = 0; i < length; ++i) {
-		size_t index = i * 8;
+static void set_alpha_sse(uint32_t *dest, const uint32_t *orig, size_t count, float alpha) {
+	uint16_t alpha_factor = fade_alpha_factor(alpha);
+	__m128i alpha_vec = _mm_set1_epi16(alpha_factor);
+	__m128i dummy_vec = _mm_setzero_si128();
 
-		// Read data into SSE register, where each byte is an u16
-		__m128i argb_vec = _mm_loadu_si64(orig_bytes + index);
-		argb_vec = _mm_unpacklo_epi8(argb_vec, dummy_vec);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		// Each byte of the 4 pixels becomes an u16, multiplied by alpha
+		__m128i argb_vec = _mm_loadu_si128((const __m128i *)(orig + i));
+		__m128i lo = _mm_mulhi_epu16(_mm_unpacklo_epi8(argb_vec, dummy_vec), alpha_vec);
+		__m128i hi = _mm_mulhi_epu16(_mm_unpackhi_epi8(argb_vec, dummy_vec), alpha_vec);
+		_mm_storeu_si128((__m128i *)(dest + i), _mm_packus_epi16(lo, hi));
+	}
+	for (; i < count; ++i) {
+		dest[i] = fade_alpha_pixel(orig[i], alpha_factor);
+	}
+}
 
-		// Multiply the 8 argb u16s with the 8 alpha u16s
-		argb_vec = _mm_mulhi_epu16(argb_vec, alpha_vec);
+static void set_blend_sse(uint32_t *dest, const uint32_t *from, const uint32_t *orig,
+		size_t count, float alpha) {
+	uint16_t alpha_factor = fade_alpha_factor(alpha);
+	__m128i alpha_vec = _mm_set1_epi16(alpha_factor);
+	__m128i inv_alpha_vec = _mm_set1_epi16(0xffff - alpha_factor);
+	__m128i dummy_vec = _mm_setzero_si128();
 
-		// Put the low bytes of each argb u16 into the destination buffer
-		argb_vec = _mm_packus_epi16(argb_vec, dummy_vec);
-		_mm_storeu_si64(dest_bytes + index, argb_vec);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i from_vec = _mm_loadu_si128((const __m128i *)(from + i));
+		__m128i argb_vec = _mm_loadu_si128((const __m128i *)(orig + i));
+
+		// from * (1 - alpha) + orig * alpha
+		__m128i lo = _mm_add_epi16(
+				_mm_mulhi_epu16(_mm_unpacklo_epi8(from_vec, dummy_vec), inv_alpha_vec),
+				_mm_mulhi_epu16(_mm_unpacklo_epi8(argb_vec, dummy_vec), alpha_vec));
+		__m128i hi = _mm_add_epi16(
+				_mm_mulhi_epu16(_mm_unpackhi_epi8(from_vec, dummy_vec), inv_alpha_vec),
+				_mm_mulhi_epu16(_mm_unpackhi_epi8(argb_vec, dummy_vec), alpha_vec));
+		_mm_storeu_si128((__m128i *)(dest + i), _mm_packus_epi16(lo, hi));
+	}
+	for (; i < count; ++i) {
+		dest[i] = fade_blend_pixel(from[i], orig[i], alpha_factor);
+	}
+}
+
+// The unpacks and the pack work within each 128-bit lane, so the pixels
+// come out in the order they went in. Nothing reads the buffer back but the
+// compositor, so the stores go around the cache once dest is aligned.
+__attribute__((target("avx2")))
+static void set_alpha_avx2(uint32_t *dest, const uint32_t *orig, size_t count, float alpha) {
+	uint16_t alpha_factor = fade_alpha_factor(alpha);
+	__m256i alpha_vec = _mm256_set1_epi16(alpha_factor);
+	__m256i dummy_vec = _mm256_setzero_si256();
+
+	size_t i = 0;
+	for (; i < count && ((uintptr_t)(dest + i) & 31) != 0; ++i) {
+		dest[i] = fade_alpha_pixel(orig[i], alpha_factor);
+	}
+	for (; i + 8 <= count; i += 8) {
+		__m256i argb_vec = _mm256_loadu_si256((const __m256i *)(orig + i));
+		__m256i lo = _mm256_mulhi_epu16(_mm256_unpacklo_epi8(argb_vec, dummy_vec), alpha_vec);
+		__m256i hi = _mm256_mulhi_epu16(_mm256_unpackhi_epi8(argb_vec, dummy_vec), alpha_vec);
+		_mm256_stream_si256((__m256i *)(dest + i), _mm256_packus_epi16(lo, hi));
+	}
+	_mm_sfence();
+	for (; i < count; ++i) {
+		dest[i] = fade_alpha_pixel(orig[i], alpha_factor);
+	}
+}
+
+__attribute__((target("avx2")))
+static void set_blend_avx2(uint32_t *dest, const uint32_t *from, const uint32_t *orig,
+		size_t count, float alpha) {
+	uint16_t alpha_factor = fade_alpha_factor(alpha);
+	__m256i alpha_vec = _mm256_set1_epi16(alpha_factor);
+	__m256i inv_alpha_vec = _mm256_set1_epi16(0xffff - alpha_factor);
+	__m256i dummy_vec = _mm256_setzero_si256();
+
+	size_t i = 0;
+	for (; i < count && ((uintptr_t)(dest + i) & 31) != 0; ++i) {
+		dest[i] = fade_blend_pixel(from[i], orig[i], alpha_factor);
+	}
+	for (; i + 8 <= count; i += 8) {
+		__m256i from_vec = _mm256_loadu_si256((const __m256i *)(from + i));
+		__m256i argb_vec = _mm256_loadu_si256((const __m256i *)(orig + i));
+		__m256i lo = _mm256_add_epi16(
+				_mm256_mulhi_epu16(_mm256_unpacklo_epi8(from_vec, dummy_vec), inv_alpha_vec),
+				_mm256_mulhi_epu16(_mm256_unpacklo_epi8(argb_vec, dummy_vec), alpha_vec));
+		__m256i hi = _mm256_add_epi16(
+				_mm256_mulhi_epu16(_mm256_unpackhi_epi8(from_vec, dummy_vec), inv_alpha_vec),
+				_mm256_mulhi_epu16(_mm256_unpackhi_epi8(argb_vec, dummy_vec), alpha_vec));
+		_mm256_stream_si256((__m256i *)(dest + i), _mm256_packus_epi16(lo, hi));
+	}
+	_mm_sfence();
+	for (; i < count; ++i) {
+		dest[i] = fade_blend_pixel(from[i], orig[i], alpha_factor);
 	}
 }
 
 #else
-#define set_alpha set_alpha_slow
-
-static void set_alpha_slow(uint32_t *orig, struct pool_buffer *buf, float alpha) {
-	for (size_t y = 0; y < buf->height; ++y) {
-		for (size_t x = 0; x < buf->width; ++x) {
-			size_t index = y * buf->width + x;
-			uint32_t srcpix = orig[index];
-			int srcr = (srcpix & 0x00ff0000u) >> 16;
-			int srcg = (srcpix & 0x0000ff00u) >> 8;
-			int srcb = (srcpix & 0x000000ffu);
-
-			((uint32_t *)buf->data)[index] = 0 |
-				(uint32_t)(alpha * 255) << 24 |
-				(uint32_t)(srcr * alpha) << 16 |
-				(uint32_t)(srcg * alpha) << 8 |
-				(uint32_t)(srcb * alpha);
+
+static void set_alpha_slow(uint32_t *dest, const uint32_t *orig, size_t count, float alpha) {
+	for (size_t index = 0; index < count; ++index) {
+		uint32_t srcpix = orig[index];
+		int srcr = (srcpix & 0x00ff0000u) >> 16;
+		int srcg = (srcpix & 0x0000ff00u) >> 8;
+		int srcb = (srcpix & 0x000000ffu);
+
+		dest[index] = 0 |
+			(uint32_t)(alpha * 255) << 24 |
+			(uint32_t)(srcr * alpha) << 16 |
+			(uint32_t)(srcg * alpha) << 8 |
+			(uint32_t)(srcb * alpha);
+	}
+}
+
+static void set_blend_slow(uint32_t *dest, const uint32_t *from, const uint32_t *orig,
+		size_t count, float alpha) {
+	for (size_t index = 0; index < count; ++index) {
+		uint32_t frompix = from[index];
+		uint32_t srcpix = orig[index];
+
+		uint32_t destpix = 0;
+		for (int shift = 0; shift < 32; shift += 8) {
+			int fromc = (frompix >> shift) & 0xff;
+			int srcc = (srcpix >> shift) & 0xff;
+			destpix |= (uint32_t)(fromc + (srcc - fromc) * alpha) << shift;
 		}
+		dest[index] = destpix;
 	}
 }
 
 #endif
 
+static const struct fade_kernel *fade_kernel_select(void) {
+#ifdef __SSE2__
+	static const struct fade_kernel fade_kernel_sse = { "sse2", set_alpha_sse, set_blend_sse };
+	static const struct fade_kernel fade_kernel_avx2 = { "avx2", set_alpha_avx2, set_blend_avx2 };
+	if (__builtin_cpu_supports("avx2")) {
+		return &fade_kernel_avx2;
+	}
+	return &fade_kernel_sse;
+#else
+	static const struct fade_kernel fade_kernel_scalar = { "scalar", set_alpha_slow, set_blend_slow };
+	return &fade_kernel_scalar;
+#endif
+}
+
+// Rows per piece of work; small enough to spread a 4K frame over the
+// threads, large enough that handing them out costs nothing
+#define FADE_ROWS 16
+
+static void fade_set(struct waylogout_fade *fade, struct pool_buffer *buffer, float alpha) {
+	const struct fade_kernel *kernel = fade_kernel_select();
+	uint32_t *dest = buffer->data;
+	uint32_t *from = fade->from_buffer;
+	uint32_t *orig = fade->original_buffer;
+	size_t width = buffer->width;
+	int pieces = (buffer->height + FADE_ROWS - 1) / FADE_ROWS;
+
+#pragma omp parallel for
+	for (int piece = 0; piece < pieces; ++piece) {
+		size_t y = (size_t)piece * FADE_ROWS;
+		size_t rows = buffer->height - y < FADE_ROWS ? buffer->height - y : FADE_ROWS;
+		size_t start = y * width;
+		if (from) {
+			kernel->blend(dest + start, from + start, orig + start, rows * width, alpha);
+		} else {
+			kernel->alpha(dest + start, orig + start, rows * width, alpha);
+		}
+	}
+}
+
+// Starts a new fade from the given pixels, which must be the size of the
+// buffers the fade is drawn into. The fade takes ownership of them.
+void fade_restart(struct waylogout_fade *fade, uint32_t *from_buffer, float target_time) {
+	free(fade->from_buffer);
+	fade->from_buffer = from_buffer;
+	fade->current_time = 0;
+	fade->target_time = target_time;
+	fade->old_time = 0;
+}
+
 void fade_prepare(struct waylogout_fade *fade, struct pool_buffer *buffer) {
 	if (!fade->target_time) {
 		fade->original_buffer = NULL;
@@ -81,17 +248,23 @@ void fade_prepare(struct waylogout_fade *fade, struct pool_buffer *buffer) {
 	}
 
 	size_t size = (size_t)buffer->width * (size_t)buffer->height * 4;
+	free(fade->original_buffer);
 	fade->original_buffer = malloc(size);
 	memcpy(fade->original_buffer, buffer->data, size);
 
-	set_alpha(fade->original_buffer, buffer, 0);
+	// Picks up where the fade is, in case it's being prepared again
+	// because the image changed halfway through
+	fade_set(fade, buffer, fade->current_time / fade->target_time);
 }
 
-void fade_update(struct waylogout_fade *fade, struct pool_buffer *buffer, uint32_t time) {
-	if (fade->current_time >= fade->target_time) {
-		return;
+float fade_alpha(struct waylogout_fade *fade) {
+	if (fade->target_time == 0) {
+		return 1;
 	}
+	return fade->current_time / fade->target_time;
+}
 
+float fade_advance(struct waylogout_fade *fade, uint32_t time) {
 	double delta = 0;
 	if (fade->old_time != 0) {
 		delta = time - fade->old_time;
@@ -102,21 +275,39 @@ void fade_update(struct waylogout_fade *fade, struct pool_buffer *buffer, uint32
 	if (fade->current_time > fade->target_time) {
 		fade->current_time = fade->target_time;
 	}
+	return fade_alpha(fade);
+}
+
+void fade_update(struct waylogout_fade *fade, struct pool_buffer *buffer, uint32_t time) {
+	if (fade->current_time >= fade->target_time) {
+		return;
+	}
 
-	double alpha = (double)fade->current_time / (double)fade->target_time;
+#ifdef FADE_PROFILE
+	double delta = fade->old_time != 0 ? time - fade->old_time : 0;
+#endif
+	double alpha = fade_advance(fade, time);
 
 #ifdef FADE_PROFILE
 	double before = get_time();
 #endif
 
-	set_alpha(fade->original_buffer, buffer, alpha);
+	fade_set(fade, buffer, alpha);
 
 #ifdef FADE_PROFILE
 	double after = get_time();
-	printf("set alpha in %fms (%fFPS). %fms since last time, FPS: %f\n",
+	printf("set alpha in %fms (%fFPS). %fms since last time, FPS: %f (%s)\n",
 			(after - before) * 1000, 1 / (after - before),
-			delta, 1000 / delta);
+			delta, 1000 / delta, fade_kernel_select()->name);
 #endif
+
+	// The last step is drawn; nothing reads the pixels it came from again
+	if (fade_is_complete(fade)) {
+		free(fade->from_buffer);
+		fade->from_buffer = NULL;
+		free(fade->original_buffer);
+		fade->original_buffer = NULL;
+	}
 }
 
 bool fade_is_complete(struct waylogout_fade *fade) {
@@ -125,4 +316,5 @@ bool fade_is_complete(struct waylogout_fade *fade) {
 
 void fade_destroy(struct waylogout_fade *fade) {
 	free(fade->original_buffer);
+	free(fade->from_buffer);
 }
@@ -0,0 +1,151 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include "frame-scheduler.h"
+#include "log.h"
+#include "presentation-time-client-protocol.h"
+
+#define NSEC_PER_SEC 1000000000ull
+
+// Room left for the compositor to composite the frame before the vblank
+#define FRAME_SCHEDULER_SLACK_NSEC 1000000ull
+
+struct frame_feedback {
+	struct frame_scheduler *scheduler;
+	struct wp_presentation_feedback *feedback;
+	uint64_t target_nsec; // the vblank the frame was aimed at
+	struct wl_list link;
+};
+
+static uint64_t timespec_nsec(const struct timespec *ts) {
+	return (uint64_t)ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static uint64_t now_nsec(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return timespec_nsec(&ts);
+}
+
+static void feedback_destroy(struct frame_feedback *feedback) {
+	wp_presentation_feedback_destroy(feedback->feedback);
+	wl_list_remove(&feedback->link);
+	free(feedback);
+}
+
+static void feedback_handle_sync_output(void *data,
+		struct wp_presentation_feedback *wp_feedback, struct wl_output *output) {
+	// Who cares
+}
+
+static void feedback_handle_presented(void *data,
+		struct wp_presentation_feedback *wp_feedback,
+		uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec,
+		uint32_t refresh, uint32_t seq_hi, uint32_t seq_lo, uint32_t flags) {
+	struct frame_feedback *feedback = data;
+	struct frame_scheduler *scheduler = feedback->scheduler;
+
+	uint64_t sec = ((uint64_t)tv_sec_hi << 32) | tv_sec_lo;
+	uint64_t time = sec * NSEC_PER_SEC + tv_nsec;
+	if (refresh != 0) {
+		scheduler->refresh_nsec = refresh;
+		scheduler->refresh_from_feedback = true;
+	}
+	scheduler->last_vblank_nsec = time;
+
+	// Half a refresh of leeway, for clocks that don't quite agree
+	if (time > feedback->target_nsec + scheduler->refresh_nsec / 2) {
+		++scheduler->missed;
+	} else {
+		++scheduler->presented;
+	}
+	feedback_destroy(feedback);
+}
+
+static void feedback_handle_discarded(void *data,
+		struct wp_presentation_feedback *wp_feedback) {
+	struct frame_feedback *feedback = data;
+	++feedback->scheduler->discarded;
+	feedback_destroy(feedback);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+	.sync_output = feedback_handle_sync_output,
+	.presented = feedback_handle_presented,
+	.discarded = feedback_handle_discarded,
+};
+
+void frame_scheduler_init(struct frame_scheduler *scheduler) {
+	*scheduler = (struct frame_scheduler){0};
+	wl_list_init(&scheduler->feedbacks);
+}
+
+void frame_scheduler_finish(struct frame_scheduler *scheduler) {
+	struct frame_feedback *feedback, *tmp;
+	wl_list_for_each_safe(feedback, tmp, &scheduler->feedbacks, link) {
+		feedback_destroy(feedback);
+	}
+	if (scheduler->presented + scheduler->missed + scheduler->discarded > 0) {
+		waylogout_log(LOG_DEBUG, "Frames: %lu on time, %lu missed, "
+				"%lu discarded", scheduler->presented, scheduler->missed,
+				scheduler->discarded);
+	}
+}
+
+void frame_scheduler_set_refresh(struct frame_scheduler *scheduler,
+		int32_t refresh_mhz) {
+	if (refresh_mhz <= 0 || scheduler->refresh_from_feedback) {
+		return;
+	}
+	scheduler->refresh_nsec = NSEC_PER_SEC * 1000 / (uint64_t)refresh_mhz;
+}
+
+// The first vblank after 'time'
+static uint64_t next_vblank(struct frame_scheduler *scheduler, uint64_t time) {
+	uint64_t refresh = scheduler->refresh_nsec;
+	if (refresh == 0) {
+		return time;
+	}
+	uint64_t last = scheduler->last_vblank_nsec;
+	if (last == 0) {
+		return time + refresh;
+	} else if (last > time) {
+		return last;
+	}
+	return last + ((time - last) / refresh + 1) * refresh;
+}
+
+uint64_t frame_scheduler_begin(struct frame_scheduler *scheduler,
+		struct wp_presentation *presentation, clockid_t clock,
+		struct wl_surface *surface) {
+	clock_gettime(clock, &scheduler->draw_start);
+	uint64_t now = timespec_nsec(&scheduler->draw_start);
+
+	// A frame that can't be drawn before the deadline of the next vblank
+	// makes the one after it
+	uint64_t target = next_vblank(scheduler, now);
+	if (now + scheduler->draw_nsec + FRAME_SCHEDULER_SLACK_NSEC > target) {
+		target += scheduler->refresh_nsec;
+	}
+
+	if (presentation) {
+		struct frame_feedback *feedback = calloc(1, sizeof(*feedback));
+		feedback->scheduler = scheduler;
+		feedback->target_nsec = target;
+		feedback->feedback = wp_presentation_feedback(presentation, surface);
+		wp_presentation_feedback_add_listener(feedback->feedback,
+				&feedback_listener, feedback);
+		wl_list_insert(&scheduler->feedbacks, &feedback->link);
+	}
+	return target;
+}
+
+void frame_scheduler_end(struct frame_scheduler *scheduler, clockid_t clock) {
+	uint64_t spent = now_nsec(clock) - timespec_nsec(&scheduler->draw_start);
+
+	// A moving average, which settles within a few frames
+	if (scheduler->draw_nsec == 0) {
+		scheduler->draw_nsec = spent;
+	} else {
+		scheduler->draw_nsec = (scheduler->draw_nsec * 3 + spent) / 4;
+	}
+}
@@ -0,0 +1,296 @@
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "fnv.h"
+#include "image-cache.h"
+#include "log.h"
+
+// A cache file is a header followed by the image's pixels, exactly as they
+// are laid out in the cairo surface. Files are named <path>-<key>.img, where
+// <path> is a hash of the image path and <key> a hash of everything else
+// that went into the result, so that storing a new version of an image can
+// find and delete the old ones.
+#define IMAGE_CACHE_MAGIC "WLOIMG1"
+#define IMAGE_CACHE_HEADER_SIZE 64
+
+struct image_cache_header {
+	char magic[8];
+	int32_t format;
+	int32_t width, height, stride;
+};
+
+struct image_cache_mapping {
+	void *addr;
+	size_t size;
+};
+
+static const cairo_user_data_key_t mapping_key;
+
+// Hashes a file's path along with its modification time and size,
+// so that the key changes whenever the file does.
+static uint64_t hash_file(uint64_t hash, const char *path) {
+	hash = fnv1a_string(hash, path);
+
+	struct stat st;
+	if (stat(path, &st) == 0) {
+		int64_t stamp[3] = { st.st_mtim.tv_sec, st.st_mtim.tv_nsec, st.st_size };
+		hash = fnv1a(hash, stamp, sizeof(stamp));
+	}
+	return hash;
+}
+
+static uint64_t hash_screen_pos(uint64_t hash, struct waylogout_effect_screen_pos pos) {
+	hash = fnv1a(hash, &pos.pos, sizeof(pos.pos));
+	return fnv1a(hash, &pos.is_percent, sizeof(pos.is_percent));
+}
+
+static uint64_t hash_effect(uint64_t hash, struct waylogout_effect *effect) {
+	int tag = effect->tag;
+	hash = fnv1a(hash, &tag, sizeof(tag));
+
+	switch (effect->tag) {
+	case EFFECT_BLUR:
+		hash = fnv1a(hash, &effect->e.blur, sizeof(effect->e.blur));
+		break;
+	case EFFECT_GAUSSIAN:
+		hash = fnv1a(hash, &effect->e.gaussian, sizeof(effect->e.gaussian));
+		break;
+	case EFFECT_KAWASE:
+		hash = fnv1a(hash, &effect->e.kawase, sizeof(effect->e.kawase));
+		break;
+	case EFFECT_PIXELATE:
+		hash = fnv1a(hash, &effect->e.pixelate, sizeof(effect->e.pixelate));
+		break;
+	case EFFECT_SCALE:
+		hash = fnv1a(hash, &effect->e.scale, sizeof(effect->e.scale));
+		break;
+	case EFFECT_GREYSCALE:
+		break;
+	case EFFECT_VIGNETTE:
+		hash = fnv1a(hash, &effect->e.vignette, sizeof(effect->e.vignette));
+		break;
+	case EFFECT_COMPOSE: {
+		int gravity = effect->e.compose.gravity;
+		hash = hash_screen_pos(hash, effect->e.compose.x);
+		hash = hash_screen_pos(hash, effect->e.compose.y);
+		hash = hash_screen_pos(hash, effect->e.compose.w);
+		hash = hash_screen_pos(hash, effect->e.compose.h);
+		hash = fnv1a(hash, &gravity, sizeof(gravity));
+		hash = hash_file(hash, effect->e.compose.imgpath);
+		break;
+	}
+	case EFFECT_CUSTOM:
+		hash = hash_file(hash, effect->e.custom.path);
+		break;
+	}
+
+	return hash;
+}
+
+static uint64_t image_cache_key(const char *path, int scale,
+		struct waylogout_effect *effects, int effects_count) {
+	uint64_t hash = fnv1a_string(FNV_OFFSET_BASIS, WAYLOGOUT_VERSION);
+	hash = hash_file(hash, path);
+	hash = fnv1a(hash, &scale, sizeof(scale));
+	for (int i = 0; i < effects_count; ++i) {
+		hash = hash_effect(hash, &effects[i]);
+	}
+	return hash;
+}
+
+static char *cachepath = NULL;
+static pthread_once_t cachepath_once = PTHREAD_ONCE_INIT;
+
+static void image_cache_dir_init(void) {
+	char *xdgdir = getenv("XDG_CACHE_HOME");
+	char *basedir;
+	if (xdgdir) {
+		basedir = strdup(xdgdir);
+	} else {
+		char *homedir = getenv("HOME");
+		if (homedir == NULL) {
+			waylogout_log(LOG_ERROR,
+					"Can't cache images; neither $HOME nor $XDG_CACHE_HOME "
+					"is defined.");
+			return;
+		}
+
+		basedir = malloc(strlen(homedir) + strlen("/.cache") + 1);
+		sprintf(basedir, "%s/.cache", homedir);
+		if (mkdir(basedir, 0700) < 0 && errno != EEXIST) {
+			waylogout_log(LOG_ERROR, "Can't cache images; mkdir %s failed: %s",
+					basedir, strerror(errno));
+			free(basedir);
+			return;
+		}
+	}
+
+	char *path = malloc(strlen(basedir) + strlen("/waylogout") + 1);
+	sprintf(path, "%s/waylogout", basedir);
+	free(basedir);
+	if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+		waylogout_log(LOG_ERROR, "Can't cache images; mkdir %s failed: %s",
+				path, strerror(errno));
+		free(path);
+		return;
+	}
+
+	cachepath = path;
+}
+
+// Images are loaded and stored from the worker threads
+static const char *image_cache_dir(void) {
+	pthread_once(&cachepath_once, image_cache_dir_init);
+	return cachepath;
+}
+
+static void unmap_cache_file(void *data) {
+	struct image_cache_mapping *mapping = data;
+	munmap(mapping->addr, mapping->size);
+	free(mapping);
+}
+
+cairo_surface_t *image_cache_load(const char *path, int scale,
+		struct waylogout_effect *effects, int effects_count) {
+	const char *dir = image_cache_dir();
+	if (dir == NULL) {
+		return NULL;
+	}
+
+	uint64_t pathhash = fnv1a_string(FNV_OFFSET_BASIS, path);
+	uint64_t key = image_cache_key(path, scale, effects, effects_count);
+	char filename[PATH_MAX];
+	snprintf(filename, sizeof(filename), "%s/%016" PRIx64 "-%016" PRIx64 ".img",
+			dir, pathhash, key);
+
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < IMAGE_CACHE_HEADER_SIZE) {
+		close(fd);
+		return NULL;
+	}
+
+	// Mapped privately, so that nothing drawing on the surface could ever
+	// write to the cache file
+	size_t size = st.st_size;
+	void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		waylogout_log(LOG_ERROR, "Failed to map cached image %s: %s",
+				filename, strerror(errno));
+		return NULL;
+	}
+
+	struct image_cache_header *header = addr;
+	if (memcmp(header->magic, IMAGE_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+			header->width <= 0 || header->height <= 0 ||
+			header->stride != cairo_format_stride_for_width(header->format, header->width) ||
+			size != IMAGE_CACHE_HEADER_SIZE + (size_t)header->stride * header->height) {
+		waylogout_log(LOG_DEBUG, "Ignoring invalid cached image %s", filename);
+		munmap(addr, size);
+		return NULL;
+	}
+
+	cairo_surface_t *surface = cairo_image_surface_create_for_data(
+			(unsigned char *)addr + IMAGE_CACHE_HEADER_SIZE,
+			header->format, header->width, header->height, header->stride);
+	struct image_cache_mapping *mapping = malloc(sizeof(*mapping));
+	mapping->addr = addr;
+	mapping->size = size;
+	if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS ||
+			cairo_surface_set_user_data(surface, &mapping_key,
+				mapping, unmap_cache_file) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(surface);
+		unmap_cache_file(mapping);
+		return NULL;
+	}
+
+	waylogout_log(LOG_DEBUG, "Loaded %s from cache %s", path, filename);
+	return surface;
+}
+
+// Deletes the cache files of every other version of the image
+static void image_cache_prune(const char *dir, const char *prefix, const char *keep) {
+	DIR *d = opendir(dir);
+	if (d == NULL) {
+		return;
+	}
+
+	struct dirent *ent;
+	while ((ent = readdir(d)) != NULL) {
+		if (strncmp(ent->d_name, prefix, strlen(prefix)) == 0 &&
+				strcmp(ent->d_name, keep) != 0) {
+			unlinkat(dirfd(d), ent->d_name, 0);
+		}
+	}
+	closedir(d);
+}
+
+void image_cache_store(cairo_surface_t *surface, const char *path, int scale,
+		struct waylogout_effect *effects, int effects_count) {
+	const char *dir = image_cache_dir();
+	if (dir == NULL) {
+		return;
+	}
+
+	cairo_surface_flush(surface);
+	struct image_cache_header header = {
+		.magic = IMAGE_CACHE_MAGIC,
+		.format = cairo_image_surface_get_format(surface),
+		.width = cairo_image_surface_get_width(surface),
+		.height = cairo_image_surface_get_height(surface),
+		.stride = cairo_image_surface_get_stride(surface),
+	};
+	char padding[IMAGE_CACHE_HEADER_SIZE] = { 0 };
+	memcpy(padding, &header, sizeof(header));
+
+	uint64_t pathhash = fnv1a_string(FNV_OFFSET_BASIS, path);
+	uint64_t key = image_cache_key(path, scale, effects, effects_count);
+	char prefix[32], name[64], filename[PATH_MAX], tmpname[PATH_MAX];
+	snprintf(prefix, sizeof(prefix), "%016" PRIx64 "-", pathhash);
+	snprintf(name, sizeof(name), "%s%016" PRIx64 ".img", prefix, key);
+	snprintf(filename, sizeof(filename), "%s/%s", dir, name);
+	snprintf(tmpname, sizeof(tmpname), "%s/.tmp-XXXXXX", dir);
+
+	// Written to a temporary file first, so that a concurrent load never
+	// sees a partially written image
+	int fd = mkstemp(tmpname);
+	if (fd < 0) {
+		waylogout_log(LOG_ERROR, "Failed to cache image %s: %s", path, strerror(errno));
+		return;
+	}
+
+	FILE *f = fdopen(fd, "w");
+	size_t datasize = (size_t)header.stride * header.height;
+	bool ok = f != NULL &&
+		fwrite(padding, sizeof(padding), 1, f) == 1 &&
+		fwrite(cairo_image_surface_get_data(surface), datasize, 1, f) == 1;
+	if (f != NULL) {
+		ok = fclose(f) == 0 && ok;
+	} else {
+		close(fd);
+	}
+
+	if (!ok || rename(tmpname, filename) < 0) {
+		waylogout_log(LOG_ERROR, "Failed to cache image %s: %s", path, strerror(errno));
+		unlink(tmpname);
+		return;
+	}
+
+	image_cache_prune(dir, prefix, name);
+	waylogout_log(LOG_DEBUG, "Cached %s as %s", path, filename);
+}
@@ -19,6 +19,18 @@ enum background_mode parse_background_mode(const char *mode);
 cairo_surface_t *load_background_image(const char *path);
 cairo_surface_t *load_background_from_buffer(void *buf, uint32_t format,
 		uint32_t width, uint32_t height, uint32_t stride, enum wl_output_transform transform);
+// Like load_background_from_buffer, but if the pixels can be used as they
+// are, the image is a view of the buffer instead of a copy. release(data) is
+// called once the buffer isn't needed any more; right away if it was copied.
+cairo_surface_t *load_background_from_mapping(void *buf, uint32_t format,
+		uint32_t width, uint32_t height, uint32_t stride,
+		enum wl_output_transform transform,
+		void (*release)(void *data), void *data);
+// A downscaled copy of a screenshot, made by averaging a few samples from
+// each factor x factor block
+cairo_surface_t *load_preview_from_buffer(void *buf, uint32_t format,
+		uint32_t width, uint32_t height, uint32_t stride,
+		enum wl_output_transform transform, uint32_t factor);
 void render_background_image(cairo_t *cairo, cairo_surface_t *image,
 		enum background_mode mode, int buffer_width, int buffer_height);
 
@@ -10,11 +10,19 @@ struct waylogout_effect_screen_pos {
 	bool is_percent;
 };
 
+struct waylogout_plugin;
+
 struct waylogout_effect {
 	union {
 		struct {
 			int radius, times;
 		} blur;
+		struct {
+			double sigma;
+		} gaussian;
+		struct {
+			int radius, times;
+		} kawase;
 		struct {
 			int factor;
 		} pixelate;
@@ -41,11 +49,16 @@ struct waylogout_effect {
 			} gravity;
 			char *imgpath;
 		} compose;
-		char *custom;
+		struct {
+			char *path;
+			struct waylogout_plugin *plugin;
+		} custom;
 	} e;
 
 	enum {
 		EFFECT_BLUR,
+		EFFECT_GAUSSIAN,
+		EFFECT_KAWASE,
 		EFFECT_PIXELATE,
 		EFFECT_SCALE,
 		EFFECT_GREYSCALE,
@@ -55,6 +68,23 @@ struct waylogout_effect {
 	} tag;
 };
 
+// Loads the custom effect at 'path', a shared object or C source file, or
+// returns it if it has been loaded before. Custom effects stay loaded until
+// waylogout_plugins_unload. Returns NULL, after logging why, on failure;
+// a C source file which doesn't compile is only noticed later, and its
+// effect is skipped.
+struct waylogout_plugin *waylogout_plugin_load(const char *path);
+void waylogout_plugins_unload(void);
+
+// C source plugins are compiled in the background; this waits for them to
+// finish and loads them. Returns false if any plugin failed to load.
+// The effects wait for the plugins they need by themselves.
+bool waylogout_plugins_wait(void);
+
+// The effects keep the buffers they've used for the next image; this gives
+// back the ones that are not in use.
+void waylogout_effects_trim(void);
+
 cairo_surface_t *waylogout_effects_run(cairo_surface_t *surface, int scale,
 		struct waylogout_effect *effects, int count);
 
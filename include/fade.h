@@ -11,10 +11,17 @@ struct waylogout_fade {
 	float target_time;
 	uint32_t old_time;
 	uint32_t *original_buffer;
+	uint32_t *from_buffer; // NULL to fade in from transparent
 };
 
+void fade_restart(struct waylogout_fade *fade, uint32_t *from_buffer, float target_time);
 void fade_prepare(struct waylogout_fade *fade, struct pool_buffer *buffer);
 void fade_update(struct waylogout_fade *fade, struct pool_buffer *buffer, uint32_t time);
+
+// For a fade the compositor draws: moves the fade on to the frame at 'time'
+// without drawing anything, and returns the alpha for that frame
+float fade_advance(struct waylogout_fade *fade, uint32_t time);
+float fade_alpha(struct waylogout_fade *fade);
 bool fade_is_complete(struct waylogout_fade *fade);
 void fade_destroy(struct waylogout_fade *fade);
 
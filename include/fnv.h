@@ -0,0 +1,25 @@
+#ifndef _WAYLOGOUT_FNV_H
+#define _WAYLOGOUT_FNV_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// 64-bit FNV-1a, for cache keys
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static inline uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+	const unsigned char *bytes = data;
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= bytes[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+static inline uint64_t fnv1a_string(uint64_t hash, const char *str) {
+	return fnv1a(hash, str, strlen(str) + 1);
+}
+
+#endif
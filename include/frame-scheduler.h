@@ -0,0 +1,53 @@
+#ifndef _WAYLOGOUT_FRAME_SCHEDULER_H
+#define _WAYLOGOUT_FRAME_SCHEDULER_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <wayland-client.h>
+
+/**
+ * Works out when the frames of an output's animations reach the screen.
+ *
+ * The refresh rate comes from the output's mode, and from presentation
+ * feedback once the compositor has sent some; feedback also pins down when
+ * the last vblank was. A frame is aimed at the next vblank, or at the one
+ * after that if it wouldn't be drawn in time, and animations step to the
+ * time it is aimed at rather than to the time of the frame callback.
+ */
+
+struct wp_presentation;
+
+struct frame_scheduler {
+	uint64_t refresh_nsec; // 0 if unknown
+	bool refresh_from_feedback; // which beats the output's mode
+	uint64_t last_vblank_nsec; // 0 until a frame has been presented
+	uint64_t draw_nsec; // how long a frame takes to draw, on average
+	struct timespec draw_start;
+	struct wl_list feedbacks; // frame_feedback.link, waiting for the compositor
+
+	// What became of the frames that asked for feedback: presented at
+	// the vblank they were aimed at, presented later, or never shown
+	unsigned long presented, missed, discarded;
+};
+
+void frame_scheduler_init(struct frame_scheduler *scheduler);
+void frame_scheduler_finish(struct frame_scheduler *scheduler);
+
+/**
+ * Set the refresh rate of the output's current mode, in mHz.
+ */
+void frame_scheduler_set_refresh(struct frame_scheduler *scheduler,
+		int32_t refresh_mhz);
+
+/**
+ * Start drawing a frame of 'surface', which is committed before the matching
+ * frame_scheduler_end. Returns the time, on 'clock', at which the frame is
+ * expected on screen. If 'presentation' isn't NULL, the compositor is asked
+ * when the frame actually got there.
+ */
+uint64_t frame_scheduler_begin(struct frame_scheduler *scheduler,
+		struct wp_presentation *presentation, clockid_t clock,
+		struct wl_surface *surface);
+void frame_scheduler_end(struct frame_scheduler *scheduler, clockid_t clock);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef _WAYLOGOUT_IMAGE_CACHE_H
+#define _WAYLOGOUT_IMAGE_CACHE_H
+
+#include <cairo/cairo.h>
+#include "effects.h"
+
+// Processed --image backgrounds are cached on disk, keyed by the image file,
+// the effects applied to it and the scale they were applied at.
+
+// Returns the cached image, or NULL if there is none. The surface's pixels
+// are mapped straight from the cache file.
+cairo_surface_t *image_cache_load(const char *path, int scale,
+		struct waylogout_effect *effects, int effects_count);
+
+// Stores a processed image in the cache, replacing older versions of it.
+void image_cache_store(cairo_surface_t *surface, const char *path, int scale,
+		struct waylogout_effect *effects, int effects_count);
+
+#endif
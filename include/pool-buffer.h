@@ -4,6 +4,10 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <wayland-client.h>
+#include "shm-pool.h"
+
+#define BUFFER_POOL_MAX_DEPTH 8
+#define BUFFER_POOL_DEFAULT_DEPTH 3
 
 struct pool_buffer {
 	struct wl_buffer *buffer;
@@ -11,12 +15,47 @@ struct pool_buffer {
 	cairo_t *cairo;
 	uint32_t width, height;
 	void *data;
-	size_t size;
+	struct shm_block *block;
 	bool busy;
+	uint64_t last_used;
+	struct buffer_pool *pool;
 };
 
-struct pool_buffer *get_next_buffer(struct wl_shm *shm,
-		struct pool_buffer pool[static 2], uint32_t width, uint32_t height);
-void destroy_buffer(struct pool_buffer *buffer);
+/**
+ * The buffers a surface is drawn into. A buffer whose size no longer matches
+ * is kept, and its memory reused for the next size that fits in it.
+ */
+struct buffer_pool {
+	struct pool_buffer buffers[BUFFER_POOL_MAX_DEPTH];
+	int depth;
+	uint64_t frame;
+
+	// Called when a buffer is released after get_next_buffer came up
+	// empty, to draw what couldn't be drawn then
+	void (*idle)(void *data);
+	void *idle_data;
+	bool waiting;
+
+	// How buffers were handed out: freshly allocated or reused, and how
+	// often none could be because the compositor held every buffer
+	unsigned long allocated, reused, stalled;
+};
+
+void buffer_pool_init(struct buffer_pool *pool, int depth,
+		void (*idle)(void *data), void *idle_data);
+void buffer_pool_finish(struct buffer_pool *pool);
+
+/**
+ * Get a buffer to draw into. Buffers the compositor holds are never handed
+ * out: if it holds all of them, or no memory can be had, this returns NULL,
+ * and in the first case the pool's idle callback runs once one is released.
+ */
+struct pool_buffer *get_next_buffer(struct shm_pool *shm_pool,
+		struct buffer_pool *pool, uint32_t width, uint32_t height);
+
+/**
+ * Give back a buffer from get_next_buffer that was never attached.
+ */
+void put_back_buffer(struct pool_buffer *buffer);
 
 #endif
@@ -0,0 +1,48 @@
+#ifndef _WAYLOGOUT_SHM_POOL_H
+#define _WAYLOGOUT_SHM_POOL_H
+#include <stddef.h>
+#include <stdint.h>
+#include <wayland-client.h>
+
+/**
+ * The memory of every shm buffer: backgrounds, indicators and screencopy
+ * targets. Blocks are carved out of a few large memfds, which are each
+ * shared with the compositor once, as a wl_shm_pool, and grown in place
+ * when they run out of room. Pages that a slab grows by are faulted in on
+ * a helper thread, ahead of the blocks that will use them.
+ */
+
+struct shm_pool;
+struct shm_slab;
+
+struct shm_block {
+	void *data;
+	size_t size;
+
+	struct shm_slab *slab;
+	size_t offset;
+};
+
+struct shm_pool *shm_pool_create(struct wl_shm *shm);
+
+/**
+ * Destroy the pool. Every block must have been freed, or not be used again.
+ */
+void shm_pool_destroy(struct shm_pool *pool);
+
+/**
+ * Allocate a block of at least 'size' bytes. Must be called from the thread
+ * that talks to the compositor, since the slabs may have to grow.
+ */
+struct shm_block *shm_pool_alloc(struct shm_pool *pool, size_t size);
+
+/**
+ * Free a block, and the memory behind it. Can be called from any thread; any
+ * wl_buffer created from the block should already have been destroyed.
+ */
+void shm_block_free(struct shm_block *block);
+
+struct wl_buffer *shm_block_create_buffer(struct shm_block *block,
+		int32_t width, int32_t height, int32_t stride, uint32_t format);
+
+#endif
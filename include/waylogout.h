@@ -10,6 +10,7 @@
 #include "seat.h"
 #include "effects.h"
 #include "fade.h"
+#include "frame-scheduler.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 
 struct waylogout_colorset {
@@ -50,7 +51,11 @@ struct waylogout_args {
 	struct waylogout_effect *effects;
 	int effects_count;
 	bool time_effects;
+	bool precompile_effects;
 	uint32_t fade_in;
+	bool progressive;
+	int buffer_depth;
+	double render_scale;
 };
 
 struct waylogout_surface;
@@ -77,8 +82,18 @@ struct waylogout_action {
 	struct wl_surface *child_surface; // surface made into subsurface
 	struct wl_subsurface *subsurface;
 	struct waylogout_surface *parent_surface;
-	struct pool_buffer indicator_buffers[2];
+	struct buffer_pool indicator_buffers;
 	uint32_t indicator_width, indicator_height;
+	// The indicator as last drawn when not selected and when selected,
+	// re-attached as long as nothing it was drawn from changes
+	struct waylogout_sprite {
+		struct pool_buffer *buffer; // NULL if there is none
+		uint64_t last_used; // the buffer's, when it was drawn
+		int32_t scale;
+		enum wl_output_subpixel subpixel;
+		uint32_t inside, ring, text, line;
+	} sprites[2];
+	struct pool_buffer *attached_sprite; // what child_surface shows
 	struct wl_list link;
 };
 
@@ -101,6 +116,7 @@ struct waylogout_state {
 	struct zwlr_input_inhibit_manager_v1 *input_inhibit_manager;
 	struct zwlr_screencopy_manager_v1 *screencopy_manager;
 	struct wl_shm *shm;
+	struct shm_pool *shm_pool; // every buffer's memory comes from here
 	struct wl_list surfaces;
 	struct wl_list images;
 	struct wl_surface *cursor_surface;
@@ -116,15 +132,26 @@ struct waylogout_state {
 	size_t n_screenshots_done;
 	bool run_display;
 	struct zxdg_output_manager_v1 *zxdg_output_manager;
+	struct wp_viewporter *viewporter;
+	struct wp_single_pixel_buffer_manager_v1 *single_pixel_buffer_manager;
+	struct wp_alpha_modifier_v1 *alpha_modifier;
+	struct wp_presentation *presentation;
+	clockid_t presentation_clock; // what frame times are measured on
+	struct worker_pool *workers; // effects run here, off the event loop
+	int images_pending;
 };
 
 struct waylogout_surface {
 	cairo_surface_t *image;
+	bool image_reduced; // drawn at --render-scale, and scaled up by the viewport
 	struct {
 		uint32_t format, width, height, stride;
 		enum wl_output_transform transform;
-		void *data;
+		struct wl_buffer *buffer;
+		struct shm_block *block;
 		struct waylogout_image *image;
+		struct screenshot_job *job; // while the effects are running
+		cairo_surface_t *preview; // shown meanwhile, with --progressive
 	} screencopy;
 	struct waylogout_state *state;
 	struct wl_output *output;
@@ -133,9 +160,28 @@ struct waylogout_surface {
 	struct wl_surface *surface;
 	struct zwlr_layer_surface_v1 *layer_surface;
 	struct zwlr_screencopy_frame_v1 *screencopy_frame;
-	struct pool_buffer buffers[2];
+	struct buffer_pool buffers;
 	struct pool_buffer *current_buffer;
+	// The finished background, re-attached as long as nothing it was
+	// drawn from changes
+	struct {
+		struct pool_buffer *buffer; // NULL if there is none
+		uint64_t last_used; // the buffer's, when it was drawn
+		int width, height, scale;
+		enum background_mode mode;
+		cairo_surface_t *image;
+		bool attached;
+	} background;
+	// A solid colour background is a single pixel, stretched over the
+	// output by the viewport
+	struct wp_viewport *viewport;
+	struct {
+		struct wl_buffer *buffer;
+		uint32_t width, height; // 0 if not attached
+	} solid;
 	struct waylogout_fade fade;
+	struct wp_alpha_modifier_surface_v1 *alpha_modifier; // fades, if there is one
+	struct frame_scheduler scheduler;
 	int events_pending;
 	bool configured;
 	bool frame_pending, dirty;
@@ -195,6 +241,7 @@ void waylogout_handle_touch_motion(struct waylogout_state *state,
 void render_frame_background(struct waylogout_surface *surface);
 void render_background_fade(struct waylogout_surface *surface, uint32_t time);
 void render_background_fade_prepare(struct waylogout_surface *surface, struct pool_buffer *buffer);
+uint32_t *render_background_pixels(struct waylogout_surface *surface);
 void render_frame(struct waylogout_action *action,
 		struct waylogout_surface *surface,
 		struct waylogout_frame_common fr_common);
@@ -0,0 +1,49 @@
+#ifndef _WAYLOGOUT_WORKER_H
+#define _WAYLOGOUT_WORKER_H
+#include <stdbool.h>
+
+/**
+ * A pool of threads to run long jobs, such as effect chains, away from the
+ * Wayland event loop.
+ *
+ * Each job has two halves: run() is called on one of the pool's threads, and
+ * done() is called afterwards on the thread that calls worker_pool_dispatch.
+ * The pool's fd becomes readable whenever a job is done, so that it can be
+ * added to an event loop.
+ */
+
+struct worker_pool;
+
+/**
+ * Create a pool. A count of 0 picks one thread per CPU, up to a small limit.
+ */
+struct worker_pool *worker_pool_create(int threads);
+
+/**
+ * Destroy the pool, waiting for queued jobs to run first. The done() halves
+ * of jobs that have not been dispatched are not called.
+ */
+void worker_pool_destroy(struct worker_pool *pool);
+
+/**
+ * Queue a job. done may be NULL.
+ */
+void worker_pool_submit(struct worker_pool *pool,
+		void (*run)(void *data), void (*done)(void *data), void *data);
+
+/**
+ * Get the fd which is readable while finished jobs are waiting for dispatch.
+ */
+int worker_pool_get_fd(struct worker_pool *pool);
+
+/**
+ * Call done() for every job that has finished running.
+ */
+void worker_pool_dispatch(struct worker_pool *pool);
+
+/**
+ * Check whether every job has been run and dispatched.
+ */
+bool worker_pool_is_idle(struct worker_pool *pool);
+
+#endif
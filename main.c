@@ -1,27 +1,37 @@
 #define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <getopt.h>
+#include <math.h>
 #include <poll.h>
 #include <stdbool.h>
 #include <string.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
 #include <wayland-client.h>
 #include <wayland-cursor.h>
 #include <wordexp.h>
 #include "background-image.h"
 #include "cairo.h"
+#include "frame-scheduler.h"
+#include "image-cache.h"
 #include "log.h"
 #include "loop.h"
 #include "pool-buffer.h"
 #include "seat.h"
+#include "shm-pool.h"
 #include "waylogout.h"
+#include "worker.h"
 #include "wlr-input-inhibitor-unstable-v1-client-protocol.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 #include "wlr-screencopy-unstable-v1-client-protocol.h"
 #include "xdg-output-unstable-v1-client-protocol.h"
+#include "viewporter-client-protocol.h"
+#include "presentation-time-client-protocol.h"
+#if HAVE_SINGLE_PIXEL_BUFFER
+#include "single-pixel-buffer-v1-client-protocol.h"
+#endif
+#if HAVE_ALPHA_MODIFIER
+#include "alpha-modifier-v1-client-protocol.h"
+#endif
 
 // returns a positive integer in milliseconds
 static uint32_t parse_seconds(const char *seconds) {
@@ -188,22 +198,60 @@ int lenient_strcmp(char *a, char *b) {
 	}
 }
 
+// With --progressive, screenshots are previewed at this fraction of their
+// size, and the processed screenshot fades in over this many milliseconds
+#define PREVIEW_FACTOR 8
+#define PROGRESSIVE_FADE_TIME 250
+
+// A screenshot is converted and run through the effects on the worker pool.
+// The job has its own copy of everything it needs from the surface, which
+// may be destroyed while the job runs.
+struct screenshot_job {
+	struct waylogout_surface *surface; // NULL once the surface is destroyed
+	struct waylogout_state *state;
+	struct waylogout_image *image;
+	struct wl_buffer *buffer;
+	struct shm_block *block;
+	struct screenshot_mapping *mapping;
+	uint32_t format, width, height, stride;
+	enum wl_output_transform transform;
+	int scale;
+	bool progressive; // the surface doesn't wait for the job
+	bool reduced; // the effects shrink the image by --render-scale
+};
+
 static void destroy_surface(struct waylogout_surface *surface) {
 	waylogout_log(LOG_DEBUG, "Destroy surface for output %s", surface->output_name);
 
 	wl_list_remove(&surface->link);
+	if (surface->screencopy.job != NULL) {
+		surface->screencopy.job->surface = NULL;
+	}
+	if (surface->screencopy.preview != NULL) {
+		cairo_surface_destroy(surface->screencopy.preview);
+	}
 	if (surface->layer_surface != NULL) {
 		zwlr_layer_surface_v1_destroy(surface->layer_surface);
 	}
+	if (surface->viewport != NULL) {
+		wp_viewport_destroy(surface->viewport);
+	}
+#if HAVE_ALPHA_MODIFIER
+	if (surface->alpha_modifier != NULL) {
+		wp_alpha_modifier_surface_v1_destroy(surface->alpha_modifier);
+	}
+#endif
+	if (surface->solid.buffer != NULL) {
+		wl_buffer_destroy(surface->solid.buffer);
+	}
 	if (surface->surface != NULL) {
 		wl_surface_destroy(surface->surface);
 	}
-	destroy_buffer(&surface->buffers[0]);
-	destroy_buffer(&surface->buffers[1]);
+	buffer_pool_finish(&surface->buffers);
+	frame_scheduler_finish(&surface->scheduler);
 	struct waylogout_action *action_iter;
 	wl_list_for_each(action_iter, &surface->state->actions, link) {
-		destroy_buffer(&action_iter->indicator_buffers[0]);
-		destroy_buffer(&action_iter->indicator_buffers[1]);
+		buffer_pool_finish(&action_iter->indicator_buffers);
 	}
 	fade_destroy(&surface->fade);
 	wl_output_destroy(surface->output);
@@ -256,6 +304,7 @@ static void create_layer_surface(struct waylogout_surface *surface) {
 	wl_list_for_each(action_iter, &state->actions, link) {
 		action_iter->child_surface = wl_compositor_create_surface(state->compositor);
 		assert(action_iter->child_surface);
+		action_iter->attached_sprite = NULL;
 		action_iter->subsurface = wl_subcompositor_get_subsurface(
 				state->subcompositor, action_iter->child_surface,
 				surface->surface);
@@ -351,6 +400,7 @@ static const struct wl_callback_listener surface_frame_listener;
 static void surface_frame_handle_done(void *data, struct wl_callback *callback,
 		uint32_t time) {
 	struct waylogout_surface *surface = data;
+	struct waylogout_state *state = surface->state;
 
 	wl_callback_destroy(callback);
 	surface->frame_pending = false;
@@ -363,8 +413,17 @@ static void surface_frame_handle_done(void *data, struct wl_callback *callback,
 		surface->dirty = false;
 
 		if (!fade_is_complete(&surface->fade)) {
-			render_background_fade(surface, time);
+			// Steps to when this frame will be on screen, rather than
+			// to when the compositor asked for it
+			uint64_t present = frame_scheduler_begin(&surface->scheduler,
+					state->presentation, state->presentation_clock,
+					surface->surface);
+			render_background_fade(surface, present / 1000000);
+			frame_scheduler_end(&surface->scheduler, state->presentation_clock);
 			surface->dirty = true;
+		} else if (surface->events_pending == 0) {
+			// Free unless the output's scale or size changed
+			render_frame_background(surface);
 		}
 
 		render_frames(surface);
@@ -394,6 +453,15 @@ void damage_state(struct waylogout_state *state) {
 	}
 }
 
+// For when a buffer pool had none to spare, and the compositor gave one back
+static void surface_pool_idle(void *data) {
+	damage_surface(data);
+}
+
+static void actions_pool_idle(void *data) {
+	damage_state(data);
+}
+
 static void handle_wl_output_geometry(void *data, struct wl_output *wl_output,
 		int32_t x, int32_t y, int32_t width_mm, int32_t height_mm,
 		int32_t subpixel, const char *make, const char *model,
@@ -409,7 +477,11 @@ static void handle_wl_output_geometry(void *data, struct wl_output *wl_output,
 
 static void handle_wl_output_mode(void *data, struct wl_output *output,
 		uint32_t flags, int32_t width, int32_t height, int32_t refresh) {
-	// Who cares
+	waylogout_trace();
+	struct waylogout_surface *surface = data;
+	if (flags & WL_OUTPUT_MODE_CURRENT) {
+		frame_scheduler_set_refresh(&surface->scheduler, refresh);
+	}
 }
 
 static void handle_wl_output_done(void *data, struct wl_output *output) {
@@ -433,58 +505,151 @@ struct wl_output_listener _wl_output_listener = {
 	.scale = handle_wl_output_scale,
 };
 
-static struct wl_buffer *create_shm_buffer(struct wl_shm *shm, enum wl_shm_format fmt,
-		int width, int height, int stride, void **data_out) {
-	int size = stride * height;
+// A screenshot's block stays allocated until both the wl_buffer on it is
+// destroyed and no image views it any more. Either can come last, and the
+// image can let go of it on a worker thread.
+struct screenshot_mapping {
+	struct shm_block *block;
+	int refs;
+};
 
-	const char shm_name[] = "/waylogout-shm";
-	int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
-	if (fd < 0) {
-		fprintf(stderr, "shm_open failed\n");
-		return NULL;
+static void screenshot_mapping_unref(void *data) {
+	struct screenshot_mapping *mapping = data;
+	if (__atomic_sub_fetch(&mapping->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		shm_block_free(mapping->block);
+		free(mapping);
 	}
-	shm_unlink(shm_name);
+}
 
-	int ret;
-	while ((ret = ftruncate(fd, size)) == EINTR) {
-		// No-op
+static cairo_surface_t *apply_effects(cairo_surface_t *image, struct waylogout_state *state,
+		int scale, bool reduced) {
+	if (state->args.effects_count == 0) {
+		return image;
 	}
-	if (ret < 0) {
-		close(fd);
-		fprintf(stderr, "ftruncate failed\n");
-		return NULL;
+
+	// A reduced image is scaled down at the end of the chain; the effects
+	// planner moves that ahead of the blurs, which then see fewer pixels
+	struct waylogout_effect *effects = state->args.effects;
+	int count = state->args.effects_count;
+	if (reduced) {
+		effects = malloc((count + 1) * sizeof(*effects));
+		memcpy(effects, state->args.effects, count * sizeof(*effects));
+		effects[count] = (struct waylogout_effect){
+			.tag = EFFECT_SCALE,
+			.e.scale = state->args.render_scale,
+		};
+		count += 1;
 	}
 
-	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (data == MAP_FAILED) {
-		fprintf(stderr, "mmap failed: %m\n");
-		close(fd);
-		return NULL;
+	if (state->args.time_effects) {
+		image = waylogout_effects_run_timed(image, scale, effects, count);
+	} else {
+		image = waylogout_effects_run(image, scale, effects, count);
 	}
 
-	struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-	close(fd);
-	struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0, width, height,
-		stride, fmt);
-	wl_shm_pool_destroy(pool);
+	if (effects != state->args.effects) {
+		free(effects);
+	}
+	return image;
+}
 
-	*data_out = data;
-	return buffer;
+// Runs a job on the worker pool, or right away if there is no pool
+static void submit_job(struct waylogout_state *state,
+		void (*run)(void *data), void (*done)(void *data), void *data) {
+	if (state->workers) {
+		worker_pool_submit(state->workers, run, done, data);
+	} else {
+		run(data);
+		done(data);
+	}
 }
 
-static cairo_surface_t *apply_effects(cairo_surface_t *image, struct waylogout_state *state, int scale) {
-	if (state->args.effects_count == 0) {
-		return image;
+// Puts the processed screenshot in place of the preview
+static void swap_in_image(struct waylogout_surface *surface, cairo_surface_t *image,
+		bool reduced) {
+	if (surface->events_pending > 0) {
+		// Not shown yet
+		surface->image = image;
+		surface->image_reduced = reduced;
+	} else {
+		// Cross-fades from what's on screen. If the surface is still fading
+		// in, that fade simply carries on with the new image. What's on
+		// screen is captured at the size of the buffers to come.
+		surface->image_reduced = reduced;
+		if (fade_is_complete(&surface->fade)) {
+			uint32_t *from = render_background_pixels(surface);
+			if (from) {
+				fade_restart(&surface->fade, from, PROGRESSIVE_FADE_TIME);
+			}
+		}
+		surface->image = image;
+		render_frame_background(surface);
+		render_background_fade_prepare(surface, surface->current_buffer);
+		render_frames(surface);
+		damage_surface(surface);
 	}
 
-	if (state->args.time_effects) {
-		return waylogout_effects_run_timed(
-				image, scale,
-				state->args.effects, state->args.effects_count);
+	if (surface->screencopy.preview) {
+		cairo_surface_destroy(surface->screencopy.preview);
+		surface->screencopy.preview = NULL;
+	}
+}
+
+static void screenshot_job_run(void *data) {
+	struct screenshot_job *job = data;
+
+	// One reference for the image, one for the wl_buffer
+	job->mapping = calloc(1, sizeof(*job->mapping));
+	job->mapping->block = job->block;
+	job->mapping->refs = 2;
+
+	cairo_surface_t *image = load_background_from_mapping(
+			job->block->data, job->format, job->width, job->height,
+			job->stride, job->transform, screenshot_mapping_unref, job->mapping);
+	if (image == NULL) {
+		waylogout_log(LOG_ERROR, "Failed to create image from screenshot");
 	} else {
-		return waylogout_effects_run(
-				image, scale,
-				state->args.effects, state->args.effects_count);
+		job->image->cairo_surface = apply_effects(image, job->state,
+				job->scale, job->reduced);
+	}
+}
+
+static void screenshot_job_done(void *data) {
+	struct screenshot_job *job = data;
+	struct waylogout_surface *surface = job->surface;
+
+	// The compositor is done with the buffer, and the image either has
+	// its own copy of the pixels or keeps the mapping alive
+	wl_buffer_destroy(job->buffer);
+	screenshot_mapping_unref(job->mapping);
+
+	if (surface == NULL) {
+		if (job->image->cairo_surface) {
+			cairo_surface_destroy(job->image->cairo_surface);
+		}
+		free(job->image);
+		free(job);
+		return;
+	}
+
+	surface->screencopy.job = NULL;
+	waylogout_log(LOG_DEBUG, "Loaded screenshot for output %s", surface->output_name);
+	wl_list_insert(&job->state->images, &job->image->link);
+	bool progressive = job->progressive;
+	bool reduced = job->reduced;
+	cairo_surface_t *image = job->image->cairo_surface;
+	free(job);
+
+	if (!progressive) {
+		if (image) {
+			surface->image = image;
+			surface->image_reduced = reduced;
+		}
+		if (--surface->events_pending == 0) {
+			initially_render_surface(surface);
+		}
+	} else if (image) {
+		swap_in_image(surface, image, reduced);
 	}
 }
 
@@ -498,12 +663,14 @@ static void handle_screencopy_frame_buffer(void *data,
 	image->path = NULL;
 	image->output_name = surface->output_name;
 
-	void *bufdata;
-	struct wl_buffer *buf = create_shm_buffer(surface->state->shm, format, width, height, stride, &bufdata);
-	if (buf == NULL) {
+	struct shm_block *block = shm_pool_alloc(surface->state->shm_pool,
+			(size_t)stride * height);
+	if (block == NULL) {
 		free(image);
 		return;
 	}
+	struct wl_buffer *buf = shm_block_create_buffer(block, width, height,
+			stride, format);
 
 	surface->screencopy.format = format;
 	surface->screencopy.width = width;
@@ -511,7 +678,8 @@ static void handle_screencopy_frame_buffer(void *data,
 	surface->screencopy.stride = stride;
 
 	surface->screencopy.image = image;
-	surface->screencopy.data = bufdata;
+	surface->screencopy.buffer = buf;
+	surface->screencopy.block = block;
 
 	zwlr_screencopy_frame_v1_copy(frame, buf);
 }
@@ -568,26 +736,44 @@ static void handle_screencopy_frame_ready(void *data,
 		uint32_t tv_sec_lo, uint32_t tv_nsec) {
 	waylogout_trace();
 	struct waylogout_surface *surface = data;
+	zwlr_screencopy_frame_v1_destroy(frame);
+	surface->screencopy_frame = NULL;
+
+	// The surface stays pending until the job is done
+	struct screenshot_job *job = calloc(1, sizeof(struct screenshot_job));
+	job->surface = surface;
+	job->state = surface->state;
+	job->image = surface->screencopy.image;
+	job->buffer = surface->screencopy.buffer;
+	job->block = surface->screencopy.block;
+	job->format = surface->screencopy.format;
+	job->width = surface->screencopy.width;
+	job->height = surface->screencopy.height;
+	job->stride = surface->screencopy.stride;
+	job->transform = surface->screencopy.transform;
+	job->scale = surface->scale;
+	job->reduced = job->state->args.render_scale < 1 &&
+		job->state->viewporter && job->state->args.effects_count > 0;
+	surface->screencopy.job = job;
+
+	// The screenshot has been taken, so the surface can be shown now without
+	// ending up in it; a preview stands in for the screenshot meanwhile
 	struct waylogout_state *state = surface->state;
-
-	cairo_surface_t *image = load_background_from_buffer(
-			surface->screencopy.data,
-			surface->screencopy.format,
-			surface->screencopy.width,
-			surface->screencopy.height,
-			surface->screencopy.stride,
-			surface->screencopy.transform);
-	if (image == NULL) {
-		waylogout_log(LOG_ERROR, "Failed to create image from screenshot");
-	} else  {
-		surface->screencopy.image->cairo_surface =
-			apply_effects(image, state, surface->scale);
-		surface->image = surface->screencopy.image->cairo_surface;
+	if (state->args.progressive && state->args.effects_count > 0) {
+		job->progressive = true;
+		surface->screencopy.preview = load_preview_from_buffer(
+				job->block->data, job->format, job->width, job->height,
+				job->stride, job->transform, PREVIEW_FACTOR);
+		if (surface->screencopy.preview) {
+			surface->image = surface->screencopy.preview;
+		}
 	}
 
-	waylogout_log(LOG_DEBUG, "Loaded screenshot for output %s", surface->output_name);
-	wl_list_insert(&state->images, &surface->screencopy.image->link);
-	if (--surface->events_pending == 0) {
+	// Without workers, the job is done, and freed, before submit_job returns
+	bool progressive = job->progressive;
+	submit_job(state, screenshot_job_run, screenshot_job_done, job);
+
+	if (progressive && --surface->events_pending == 0) {
 		initially_render_surface(surface);
 	}
 }
@@ -597,6 +783,16 @@ static void handle_screencopy_frame_failed(void *data,
 	waylogout_trace();
 	struct waylogout_surface *surface = data;
 	waylogout_log(LOG_ERROR, "Screencopy failed");
+	zwlr_screencopy_frame_v1_destroy(frame);
+	surface->screencopy_frame = NULL;
+
+	if (surface->screencopy.buffer) {
+		wl_buffer_destroy(surface->screencopy.buffer);
+		shm_block_free(surface->screencopy.block);
+		free(surface->screencopy.image);
+		surface->screencopy.buffer = NULL;
+		surface->screencopy.image = NULL;
+	}
 
 	if (--surface->events_pending == 0) {
 		initially_render_surface(surface);
@@ -675,6 +871,16 @@ struct zxdg_output_v1_listener _xdg_output_listener = {
 	.description = handle_xdg_output_description,
 };
 
+static void handle_presentation_clock_id(void *data,
+		struct wp_presentation *presentation, uint32_t clk_id) {
+	struct waylogout_state *state = data;
+	state->presentation_clock = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+	.clock_id = handle_presentation_clock_id,
+};
+
 static void handle_global(void *data, struct wl_registry *registry,
 		uint32_t name, const char *interface, uint32_t version) {
 
@@ -688,6 +894,24 @@ static void handle_global(void *data, struct wl_registry *registry,
 	} else if (strcmp(interface, wl_shm_interface.name) == 0) {
 		state->shm = wl_registry_bind(registry, name,
 				&wl_shm_interface, 1);
+	} else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+		state->viewporter = wl_registry_bind(registry, name,
+				&wp_viewporter_interface, 1);
+	} else if (strcmp(interface, wp_presentation_interface.name) == 0) {
+		state->presentation = wl_registry_bind(registry, name,
+				&wp_presentation_interface, 1);
+		wp_presentation_add_listener(state->presentation,
+				&presentation_listener, state);
+#if HAVE_SINGLE_PIXEL_BUFFER
+	} else if (strcmp(interface, wp_single_pixel_buffer_manager_v1_interface.name) == 0) {
+		state->single_pixel_buffer_manager = wl_registry_bind(registry, name,
+				&wp_single_pixel_buffer_manager_v1_interface, 1);
+#endif
+#if HAVE_ALPHA_MODIFIER
+	} else if (strcmp(interface, wp_alpha_modifier_v1_interface.name) == 0) {
+		state->alpha_modifier = wl_registry_bind(registry, name,
+				&wp_alpha_modifier_v1_interface, 1);
+#endif
 	} else if (strcmp(interface, wl_seat_interface.name) == 0) {
 		struct wl_seat *seat = wl_registry_bind(
 				registry, name, &wl_seat_interface, 4);
@@ -711,6 +935,9 @@ static void handle_global(void *data, struct wl_registry *registry,
 		surface->output = wl_registry_bind(registry, name,
 				&wl_output_interface, 3);
 		surface->output_global_name = name;
+		buffer_pool_init(&surface->buffers, state->args.buffer_depth,
+				surface_pool_idle, surface);
+		frame_scheduler_init(&surface->scheduler);
 		wl_output_add_listener(surface->output, &_wl_output_listener, surface);
 		wl_list_insert(&state->surfaces, &surface->link);
 
@@ -797,7 +1024,6 @@ static void load_image(char *arg, struct waylogout_state *state) {
 						image->path);
 			}
 			wl_list_remove(&iter_image->link);
-			free(iter_image->cairo_surface);
 			free(iter_image->output_name);
 			free(iter_image->path);
 			free(iter_image);
@@ -821,18 +1047,75 @@ static void load_image(char *arg, struct waylogout_state *state) {
 		wordfree(&p);
 	}
 
-	// Load the actual image
+	// The image itself is loaded by load_images, once all options are known;
+	// with the effects applied, it might be in the cache.
+	wl_list_insert(&state->images, &image->link);
+	waylogout_log(LOG_DEBUG, "Using image %s for output %s", image->path,
+			image->output_name ? image->output_name : "*");
+}
+
+struct image_job {
+	struct waylogout_state *state;
+	struct waylogout_image *image;
+};
+
+static void image_job_run(void *data) {
+	struct image_job *job = data;
+	struct waylogout_state *state = job->state;
+	struct waylogout_image *image = job->image;
+
 	image->cairo_surface = load_background_image(image->path);
 	if (!image->cairo_surface) {
-		free(image);
 		return;
 	}
 
-	wl_list_insert(&state->images, &image->link);
+	image->cairo_surface = apply_effects(image->cairo_surface, state, 1, false);
+	if (image->cairo_surface) {
+		image_cache_store(image->cairo_surface, image->path, 1,
+				state->args.effects, state->args.effects_count);
+	}
+}
+
+static void image_job_done(void *data) {
+	struct image_job *job = data;
+	struct waylogout_image *image = job->image;
+	job->state->images_pending -= 1;
+	free(job);
+
+	if (!image->cairo_surface) {
+		wl_list_remove(&image->link);
+		free(image->output_name);
+		free(image->path);
+		free(image);
+		return;
+	}
 	waylogout_log(LOG_DEBUG, "Loaded image %s for output %s", image->path,
 			image->output_name ? image->output_name : "*");
 }
 
+static void load_images(struct waylogout_state *state) {
+	struct waylogout_image *image, *temp;
+	wl_list_for_each_safe(image, temp, &state->images, link) {
+		image->cairo_surface = image_cache_load(image->path, 1,
+				state->args.effects, state->args.effects_count);
+		if (image->cairo_surface) {
+			continue;
+		}
+
+		struct image_job *job = calloc(1, sizeof(struct image_job));
+		job->state = state;
+		job->image = image;
+		state->images_pending += 1;
+		submit_job(state, image_job_run, image_job_done, job);
+	}
+
+	// Whether an output takes a screenshot depends on which images loaded,
+	// so they are all needed before any surface is created
+	while (state->images_pending > 0) {
+		loop_poll(state->eventloop);
+	}
+}
+
 static void set_default_colors(struct waylogout_colors *colors) {
 	colors->background = 0xFFFFFFFF;
 	colors->inside = (struct waylogout_colorset){
@@ -887,17 +1170,9 @@ static void add_action(struct waylogout_state *state,
 	}
 	new_action->shortcut = shortcut;
 
-	for (size_t i = 0; i < 2; ++i)
-		new_action->indicator_buffers[i] = (struct pool_buffer){
-			.buffer = NULL,
-			.surface = NULL,
-			.cairo = NULL,
-			.width = 0,
-			.height = 0,
-			.data = NULL,
-			.size = 0,
-			.busy = false
-		};
+	// Sized once all the options are in
+	buffer_pool_init(&new_action->indicator_buffers, BUFFER_POOL_DEFAULT_DEPTH,
+			NULL, NULL);
 
 	// insert new action at end of list
 	wl_list_insert(state->actions.prev, &new_action->link);
@@ -977,6 +1252,8 @@ static int parse_options(int argc, char **argv, struct waylogout_state *state,
 		LO_TEXT_COLOR,
 		LO_TEXT_HL_COLOR,
 		LO_EFFECT_BLUR,
+		LO_EFFECT_GAUSSIAN,
+		LO_EFFECT_KAWASE,
 		LO_EFFECT_PIXELATE,
 		LO_EFFECT_SCALE,
 		LO_EFFECT_GREYSCALE,
@@ -984,7 +1261,11 @@ static int parse_options(int argc, char **argv, struct waylogout_state *state,
 		LO_EFFECT_COMPOSE,
 		LO_EFFECT_CUSTOM,
 		LO_TIME_EFFECTS,
+		LO_PRECOMPILE_EFFECTS,
 		LO_FADE_IN,
+		LO_PROGRESSIVE,
+		LO_BUFFERS,
+		LO_RENDER_SCALE,
 		LO_LABELS,
 		LO_SELECTION_LABEL,
 		LO_HIDE_CANCEL,
@@ -1034,6 +1315,8 @@ static int parse_options(int argc, char **argv, struct waylogout_state *state,
 		{"text-color", required_argument, NULL, LO_TEXT_COLOR},
 		{"text-selection-color", required_argument, NULL, LO_TEXT_HL_COLOR},
 		{"effect-blur", required_argument, NULL, LO_EFFECT_BLUR},
+		{"effect-gaussian", required_argument, NULL, LO_EFFECT_GAUSSIAN},
+		{"effect-kawase", required_argument, NULL, LO_EFFECT_KAWASE},
 		{"effect-pixelate", required_argument, NULL, LO_EFFECT_PIXELATE},
 		{"effect-scale", required_argument, NULL, LO_EFFECT_SCALE},
 		{"effect-greyscale", no_argument, NULL, LO_EFFECT_GREYSCALE},
@@ -1041,7 +1324,11 @@ static int parse_options(int argc, char **argv, struct waylogout_state *state,
 		{"effect-compose", required_argument, NULL, LO_EFFECT_COMPOSE},
 		{"effect-custom", required_argument, NULL, LO_EFFECT_CUSTOM},
 		{"time-effects", no_argument, NULL, LO_TIME_EFFECTS},
+		{"precompile-effects", no_argument, NULL, LO_PRECOMPILE_EFFECTS},
 		{"fade-in", required_argument, NULL, LO_FADE_IN},
+		{"progressive", no_argument, NULL, LO_PROGRESSIVE},
+		{"buffers", required_argument, NULL, LO_BUFFERS},
+		{"render-scale", required_argument, NULL, LO_RENDER_SCALE},
 		{"poweroff-command", required_argument, NULL, LO_COMMAND_POWEROFF},
 		{"reboot-command", required_argument, NULL, LO_COMMAND_REBOOT},
 		{"suspend-command", required_argument, NULL, LO_COMMAND_SUSPEND},
@@ -1085,6 +1372,12 @@ static int parse_options(int argc, char **argv, struct waylogout_state *state,
 			"Show the version number and quit.\n"
 		"  --fade-in <seconds>              "
 			"Make the logout screen fade in instead of just popping in.\n"
+		"  --progressive                    "
+			"Show a preview of the screenshot while its effects run.\n"
+		"  --buffers <count>                "
+			"Sets how many buffers each surface is drawn into in turn.\n"
+		"  --render-scale <fraction>        "
+			"Run the effects on screenshots at a fraction of the resolution.\n"
 		"  --selection-label                 "
 			"Always show label on selected action.\n"
 		"  --font <font>                    "
@@ -1126,6 +1419,10 @@ static int parse_options(int argc, char **argv, struct waylogout_state *state,
 			"Sets the color of the text for the selected action indicator.\n"
 		"  --effect-blur <radius>x<times>   "
 			"Blur images.\n"
+		"  --effect-gaussian <sigma>        "
+			"Blur images with a gaussian blur.\n"
+		"  --effect-kawase <radius>x<times> "
+			"Blur images with a faster approximation of --effect-blur.\n"
 		"  --effect-pixelate <factor>       "
 			"Pixelate images.\n"
 		"  --effect-scale <scale>           "
@@ -1138,6 +1435,8 @@ static int parse_options(int argc, char **argv, struct waylogout_state *state,
 			"Apply a custom effect from a shared object or C source file.\n"
 		"  --time-effects                   "
 			"Measure the time it takes to run each effect.\n"
+		"  --precompile-effects             "
+			"Compile the custom effects written in C, then exit.\n"
 		"  --poweroff-command <command>     "
 		    "Command to run when \"poweroff\" action is activated.\n"
 		"  --reboot-command <command>       "
@@ -1345,6 +1644,32 @@ static int parse_options(int argc, char **argv, struct waylogout_state *state,
 				}
 			}
 			break;
+		case LO_EFFECT_GAUSSIAN:
+			if (state) {
+				state->args.effects = realloc(state->args.effects,
+						sizeof(*state->args.effects) * ++state->args.effects_count);
+				struct waylogout_effect *effect = &state->args.effects[state->args.effects_count - 1];
+				effect->tag = EFFECT_GAUSSIAN;
+				double *sigma = &effect->e.gaussian.sigma;
+				if (sscanf(optarg, "%lf", sigma) != 1 ||
+						!isfinite(*sigma) || *sigma < 0) {
+					waylogout_log(LOG_ERROR, "Invalid gaussian effect argument %s, ignoring", optarg);
+					state->args.effects_count -= 1;
+				}
+			}
+			break;
+		case LO_EFFECT_KAWASE:
+			if (state) {
+				state->args.effects = realloc(state->args.effects,
+						sizeof(*state->args.effects) * ++state->args.effects_count);
+				struct waylogout_effect *effect = &state->args.effects[state->args.effects_count - 1];
+				effect->tag = EFFECT_KAWASE;
+				if (sscanf(optarg, "%dx%d", &effect->e.kawase.radius, &effect->e.kawase.times) != 2) {
+					waylogout_log(LOG_ERROR, "Invalid kawase effect argument %s, ignoring", optarg);
+					state->args.effects_count -= 1;
+				}
+			}
+			break;
 		case LO_EFFECT_PIXELATE:
 			if (state) {
 				state->args.effects = realloc(state->args.effects,
@@ -1401,7 +1726,13 @@ static int parse_options(int argc, char **argv, struct waylogout_state *state,
 						sizeof(*state->args.effects) * ++state->args.effects_count);
 				struct waylogout_effect *effect = &state->args.effects[state->args.effects_count - 1];
 				effect->tag = EFFECT_CUSTOM;
-				effect->e.custom = strdup(optarg);
+				effect->e.custom.plugin = waylogout_plugin_load(optarg);
+				if (effect->e.custom.plugin) {
+					effect->e.custom.path = strdup(optarg);
+				} else {
+					waylogout_log(LOG_ERROR, "Invalid custom effect %s, ignoring", optarg);
+					state->args.effects_count -= 1;
+				}
 			}
 			break;
 		case LO_TIME_EFFECTS:
@@ -1409,11 +1740,43 @@ static int parse_options(int argc, char **argv, struct waylogout_state *state,
 				state->args.time_effects = true;
 			}
 			break;
+		case LO_PRECOMPILE_EFFECTS:
+			if (state) {
+				state->args.precompile_effects = true;
+			}
+			break;
 		case LO_FADE_IN:
 			if (state) {
 				state->args.fade_in = parse_seconds(optarg);
 			}
 			break;
+		case LO_PROGRESSIVE:
+			if (state) {
+				state->args.progressive = true;
+			}
+			break;
+		case LO_BUFFERS:
+			if (state) {
+				int depth = atoi(optarg);
+				if (depth < 1 || depth > BUFFER_POOL_MAX_DEPTH) {
+					waylogout_log(LOG_ERROR, "The buffer count must be between "
+							"1 and %d, ignoring %s", BUFFER_POOL_MAX_DEPTH, optarg);
+				} else {
+					state->args.buffer_depth = depth;
+				}
+			}
+			break;
+		case LO_RENDER_SCALE:
+			if (state) {
+				double fraction = strtod(optarg, NULL);
+				if (fraction <= 0 || fraction > 1) {
+					waylogout_log(LOG_ERROR, "The render scale must be above 0 "
+							"and at most 1, ignoring %s", optarg);
+				} else {
+					state->args.render_scale = fraction;
+				}
+			}
+			break;
 		case LO_COMMAND_POWEROFF:
 			if (state)
 				add_action(
@@ -1611,6 +1974,15 @@ static void display_in(int fd, short mask, void *data) {
 	}
 }
 
+static void workers_in(int fd, short mask, void *data) {
+	worker_pool_dispatch(state.workers);
+
+	// The effects' buffers are kept while there are more images to process
+	if (worker_pool_is_idle(state.workers)) {
+		waylogout_effects_trim();
+	}
+}
+
 static void timer_render(void *data) {
 	struct waylogout_state *state = (struct waylogout_state *)data;
 	damage_state(state);
@@ -1644,6 +2016,8 @@ int main(int argc, char **argv) {
 		.screenshots = false,
 		.effects = NULL,
 		.effects_count = 0,
+		.buffer_depth = BUFFER_POOL_DEFAULT_DEPTH,
+		.render_scale = 1,
 	};
 
 	wl_list_init(&state.images);
@@ -1686,6 +2060,14 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	// Custom effects written in C are compiling in the background by now
+	if (state.args.precompile_effects) {
+		bool ok = waylogout_plugins_wait();
+		waylogout_plugins_unload();
+		free(state.args.font);
+		return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
 	if (!state.args.hide_cancel)
 		add_action(&state, WL_ACTION_CANCEL, "cancel", "", NULL, XKB_KEY_c);
 
@@ -1699,6 +2081,12 @@ int main(int argc, char **argv) {
 
 	waylogout_log(LOG_DEBUG, "Found %d configured actions", n_actions);
 
+	struct waylogout_action *action;
+	wl_list_for_each(action, &state.actions, link) {
+		buffer_pool_init(&action->indicator_buffers, state.args.buffer_depth,
+				actions_pool_idle, &state);
+	}
+
 	set_default_action(&state);
 
 	state.args.scroll_sensitivity = state.args.scroll_sensitivity * 1000;
@@ -1720,10 +2108,18 @@ int main(int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
+	// Until the compositor says which clock it presents frames on
+	state.presentation_clock = CLOCK_MONOTONIC;
+
 	struct wl_registry *registry = wl_display_get_registry(state.display);
 	wl_registry_add_listener(registry, &registry_listener, &state);
 	wl_display_roundtrip(state.display);
 	assert(state.compositor && state.layer_shell && state.shm);
+	state.shm_pool = shm_pool_create(state.shm);
+	if (!state.shm_pool) {
+		free(state.args.font);
+		return 1;
+	}
 	if (!state.input_inhibit_manager) {
 		free(state.args.font);
 		waylogout_log(LOG_ERROR, "Compositor does not support the input "
@@ -1739,29 +2135,42 @@ int main(int argc, char **argv) {
 		return 2;
 	}
 
-	// Need to apply effects to all images loaded with --image
-	struct waylogout_image *iter_image, *temp;
-	wl_list_for_each_safe(iter_image, temp, &state.images, link) {
-		iter_image->cairo_surface = apply_effects(
-				iter_image->cairo_surface, &state, 1);
+	state.eventloop = loop_create();
+	loop_add_fd(state.eventloop, wl_display_get_fd(state.display), POLLIN,
+			display_in, NULL);
+
+	state.workers = worker_pool_create(0);
+	if (state.workers) {
+		loop_add_fd(state.eventloop, worker_pool_get_fd(state.workers), POLLIN,
+				workers_in, NULL);
 	}
 
+	load_images(&state);
+
 	struct waylogout_surface *surface;
 	wl_list_for_each(surface, &state.surfaces, link) {
 		create_layer_surface(surface);
 	}
 
+	// Screenshots are processed on the worker pool as they arrive, so this
+	// waits on both the compositor and the workers
 	wl_list_for_each(surface, &state.surfaces, link) {
 		while (surface->events_pending > 0) {
-			wl_display_roundtrip(state.display);
+			errno = 0;
+			if ((wl_display_flush(state.display) == -1 && errno != EAGAIN) ||
+					wl_display_get_error(state.display) != 0) {
+				waylogout_log(LOG_ERROR, "Lost connection to the compositor");
+				return EXIT_FAILURE;
+			}
+			loop_poll(state.eventloop);
 		}
 	}
 
-	create_cursor_surface(&state);
+	if (!state.workers) {
+		waylogout_effects_trim();
+	}
 
-	state.eventloop = loop_create();
-	loop_add_fd(state.eventloop, wl_display_get_fd(state.display), POLLIN,
-			display_in, NULL);
+	create_cursor_surface(&state);
 
 	loop_add_timer(state.eventloop, 1000, timer_render, &state);
 
@@ -1777,6 +2186,11 @@ int main(int argc, char **argv) {
 		loop_poll(state.eventloop);
 	}
 
+	if (state.workers) {
+		worker_pool_destroy(state.workers);
+	}
+	waylogout_plugins_unload();
+	shm_pool_destroy(state.shm_pool);
 	free(state.args.font);
 	return 0;
 }
@@ -1,72 +1,30 @@
 #define _POSIX_C_SOURCE 200809L
-#include <assert.h>
 #include <cairo/cairo.h>
-#include <fcntl.h>
-#include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
-#include <unistd.h>
 #include <wayland-client.h>
+#include "log.h"
 #include "pool-buffer.h"
 
-static bool set_cloexec(int fd) {
-	long flags = fcntl(fd, F_GETFD);
-	if (flags == -1) {
-		return false;
-	}
-
-	if (fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == -1) {
-		return false;
-	}
-
-	return true;
-}
-
-static int create_pool_file(size_t size, char **name) {
-	static const char template[] = "sway-client-XXXXXX";
-	const char *path = getenv("XDG_RUNTIME_DIR");
-	if (path == NULL) {
-		fprintf(stderr, "XDG_RUNTIME_DIR is not set\n");
-		return -1;
-	}
-
-	size_t name_size = strlen(template) + 1 + strlen(path) + 1;
-	*name = malloc(name_size);
-	if (*name == NULL) {
-		fprintf(stderr, "allocation failed\n");
-		return -1;
-	}
-	snprintf(*name, name_size, "%s/%s", path, template);
-
-	int fd = mkstemp(*name);
-	if (fd < 0) {
-		return -1;
-	}
-
-	if (!set_cloexec(fd)) {
-		close(fd);
-		return -1;
-	}
-
-	if (ftruncate(fd, size) < 0) {
-		close(fd);
-		return -1;
-	}
-
-	return fd;
-}
-
 static void buffer_release(void *data, struct wl_buffer *wl_buffer) {
 	struct pool_buffer *buffer = data;
 	buffer->busy = false;
+
+	// Whatever couldn't be drawn for want of a buffer can be now
+	struct buffer_pool *pool = buffer->pool;
+	if (pool->waiting) {
+		pool->waiting = false;
+		if (pool->idle) {
+			pool->idle(pool->idle_data);
+		}
+	}
 }
 
 static const struct wl_buffer_listener buffer_listener = {
 	.release = buffer_release
 };
 
-static struct pool_buffer *create_buffer(struct wl_shm *shm,
+// Wraps the buffer's block, allocating one if it has none
+static struct pool_buffer *create_buffer(struct shm_pool *pool,
 		struct pool_buffer *buf, int32_t width, int32_t height,
 		uint32_t format) {
 	uint32_t stride = width * 4;
@@ -74,22 +32,18 @@ static struct pool_buffer *create_buffer(struct wl_shm *shm,
 
 	void *data = NULL;
 	if (size > 0) {
-		char *name;
-		int fd = create_pool_file(size, &name);
-		assert(fd != -1);
-		data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-		struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-		buf->buffer = wl_shm_pool_create_buffer(pool, 0,
+		if (!buf->block) {
+			buf->block = shm_pool_alloc(pool, size);
+			if (!buf->block) {
+				return NULL;
+			}
+		}
+		data = buf->block->data;
+		buf->buffer = shm_block_create_buffer(buf->block,
 				width, height, stride, format);
 		wl_buffer_add_listener(buf->buffer, &buffer_listener, buf);
-		wl_shm_pool_destroy(pool);
-		close(fd);
-		unlink(name);
-		free(name);
-		fd = -1;
 	}
 
-	buf->size = size;
 	buf->width = width;
 	buf->height = height;
 	buf->data = data;
@@ -99,47 +53,129 @@ static struct pool_buffer *create_buffer(struct wl_shm *shm,
 	return buf;
 }
 
-void destroy_buffer(struct pool_buffer *buffer) {
+// Destroys everything but the block
+static void unwrap_buffer(struct pool_buffer *buffer) {
 	if (buffer->buffer) {
 		wl_buffer_destroy(buffer->buffer);
+		buffer->buffer = NULL;
 	}
 	if (buffer->cairo) {
 		cairo_destroy(buffer->cairo);
+		buffer->cairo = NULL;
 	}
 	if (buffer->surface) {
 		cairo_surface_destroy(buffer->surface);
+		buffer->surface = NULL;
 	}
-	if (buffer->data) {
-		munmap(buffer->data, buffer->size);
+	buffer->data = NULL;
+	buffer->width = buffer->height = 0;
+}
+
+static void destroy_buffer(struct pool_buffer *buffer) {
+	unwrap_buffer(buffer);
+	if (buffer->block) {
+		shm_block_free(buffer->block);
 	}
 	memset(buffer, 0, sizeof(struct pool_buffer));
 }
 
-struct pool_buffer *get_next_buffer(struct wl_shm *shm,
-		struct pool_buffer pool[static 2], uint32_t width, uint32_t height) {
-	struct pool_buffer *buffer = NULL;
+void buffer_pool_init(struct buffer_pool *pool, int depth,
+		void (*idle)(void *data), void *idle_data) {
+	memset(pool, 0, sizeof(struct buffer_pool));
+	if (depth < 1 || depth > BUFFER_POOL_MAX_DEPTH) {
+		depth = BUFFER_POOL_DEFAULT_DEPTH;
+	}
+	pool->depth = depth;
+	pool->idle = idle;
+	pool->idle_data = idle_data;
+}
+
+void buffer_pool_finish(struct buffer_pool *pool) {
+	for (int i = 0; i < BUFFER_POOL_MAX_DEPTH; ++i) {
+		destroy_buffer(&pool->buffers[i]);
+	}
+	if (pool->frame > 0) {
+		waylogout_log(LOG_DEBUG, "Buffer pool: %lu allocated, %lu reused, "
+				"%lu stalled", pool->allocated, pool->reused, pool->stalled);
+	}
+	buffer_pool_init(pool, pool->depth, pool->idle, pool->idle_data);
+}
+
+// How well a buffer fits a size, best first
+enum buffer_fit {
+	FIT_EXACT, // ready to draw into
+	FIT_RETIRED, // its block is big enough for a new wl_buffer
+	FIT_EMPTY, // no block yet
+	FIT_TOO_SMALL, // its block has to be replaced
+};
 
-	for (size_t i = 0; i < 2; ++i) {
-		if (pool[i].busy) {
+static enum buffer_fit buffer_fit(struct pool_buffer *buffer,
+		uint32_t width, uint32_t height) {
+	if (buffer->buffer && buffer->width == width && buffer->height == height) {
+		return FIT_EXACT;
+	}
+	if (!buffer->block) {
+		return FIT_EMPTY;
+	}
+	if (buffer->block->size >= (size_t)width * height * 4) {
+		return FIT_RETIRED;
+	}
+	return FIT_TOO_SMALL;
+}
+
+struct pool_buffer *get_next_buffer(struct shm_pool *shm_pool,
+		struct buffer_pool *pool, uint32_t width, uint32_t height) {
+	// The best fitting idle buffer, the least recently used of equals
+	struct pool_buffer *buffer = NULL;
+	enum buffer_fit fit = FIT_TOO_SMALL;
+	for (int i = 0; i < pool->depth; ++i) {
+		struct pool_buffer *iter = &pool->buffers[i];
+		if (iter->busy) {
 			continue;
 		}
-		buffer = &pool[i];
+		enum buffer_fit iter_fit = buffer_fit(iter, width, height);
+		if (!buffer || iter_fit < fit ||
+				(iter_fit == fit && iter->last_used < buffer->last_used)) {
+			buffer = iter;
+			fit = iter_fit;
+		}
 	}
 
+	// Every buffer is held by the compositor, which may still be reading
+	// any of them. The frame waits for the next release.
 	if (!buffer) {
+		pool->stalled += 1;
+		pool->waiting = true;
 		return NULL;
 	}
 
-	if (buffer->width != width || buffer->height != height) {
+	switch (fit) {
+	case FIT_EXACT:
+		pool->reused += 1;
+		break;
+	case FIT_RETIRED:
+		unwrap_buffer(buffer);
+		pool->reused += 1;
+		break;
+	case FIT_EMPTY:
+	case FIT_TOO_SMALL:
 		destroy_buffer(buffer);
+		pool->allocated += 1;
+		break;
 	}
 
 	if (!buffer->buffer) {
-		if (!create_buffer(shm, buffer, width, height,
+		if (!create_buffer(shm_pool, buffer, width, height,
 					WL_SHM_FORMAT_ARGB8888)) {
 			return NULL;
 		}
 	}
+	buffer->pool = pool;
 	buffer->busy = true;
+	buffer->last_used = ++pool->frame;
 	return buffer;
 }
+
+void put_back_buffer(struct pool_buffer *buffer) {
+	buffer->busy = false;
+}
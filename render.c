@@ -1,32 +1,73 @@
+#include <stdlib.h>
 #include <wayland-client.h>
 #include "cairo.h"
 #include "background-image.h"
 #include "waylogout.h"
+#include "viewporter-client-protocol.h"
+#if HAVE_SINGLE_PIXEL_BUFFER
+#include "single-pixel-buffer-v1-client-protocol.h"
+#endif
+#if HAVE_ALPHA_MODIFIER
+#include "alpha-modifier-v1-client-protocol.h"
+#endif
 
 #define M_PI 3.14159265358979323846
 
+static uint32_t color_for_state(bool selected,
+		struct waylogout_colorset *colorset) {
+	return selected ? colorset->selected : colorset->normal;
+}
+
 static void set_color_for_state(cairo_t *cairo, bool selected,
 		struct waylogout_colorset *colorset) {
-	cairo_set_source_u32(cairo, selected ? colorset->selected : colorset->normal);
+	cairo_set_source_u32(cairo, color_for_state(selected, colorset));
 }
 
-void render_frame_background(struct waylogout_surface *surface) {
-	struct waylogout_state *state = surface->state;
+// What an indicator sprite depends on, besides the action and its size
+static struct waylogout_sprite sprite_key(struct waylogout_surface *surface,
+		bool selected) {
+	struct waylogout_colors *colors = &surface->state->args.colors;
+	return (struct waylogout_sprite){
+		.scale = surface->scale,
+		.subpixel = surface->subpixel,
+		.inside = color_for_state(selected, &colors->inside),
+		.ring = color_for_state(selected, &colors->ring),
+		.text = color_for_state(selected, &colors->text),
+		.line = color_for_state(selected, &colors->line),
+	};
+}
 
-	int buffer_width = surface->width * surface->scale;
-	int buffer_height = surface->height * surface->scale;
-	if (buffer_width == 0 || buffer_height == 0) {
-		return; // not yet configured
-	}
+// Whether the action's sprite for 'selected' is still what would be drawn.
+// As with the background, a changed last_used means the pool has handed the
+// buffer out again since. The size follows from what is drawn, so it's no
+// part of the key.
+static bool sprite_is_cached(struct waylogout_action *action,
+		struct waylogout_surface *surface, bool selected) {
+	struct waylogout_sprite *sprite = &action->sprites[selected];
+	struct waylogout_sprite key = sprite_key(surface, selected);
+	struct pool_buffer *buffer = sprite->buffer;
+	return buffer != NULL &&
+		buffer->last_used == sprite->last_used &&
+		sprite->scale == key.scale &&
+		sprite->subpixel == key.subpixel &&
+		sprite->inside == key.inside &&
+		sprite->ring == key.ring &&
+		sprite->text == key.text &&
+		sprite->line == key.line;
+}
 
-	surface->current_buffer = get_next_buffer(state->shm,
-			surface->buffers, buffer_width, buffer_height);
-	if (surface->current_buffer == NULL) {
-		return;
-	}
+static void attach_sprite(struct waylogout_action *action,
+		struct waylogout_surface *surface, struct pool_buffer *buffer) {
+	action->attached_sprite = buffer;
+	wl_surface_set_buffer_scale(action->child_surface, surface->scale);
+	wl_surface_attach(action->child_surface, buffer->buffer, 0, 0);
+	wl_surface_damage_buffer(action->child_surface, 0, 0, INT32_MAX, INT32_MAX);
+	wl_surface_commit(action->child_surface);
+}
 
-	cairo_t *cairo = surface->current_buffer->cairo;
-	cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
+static void paint_background(struct waylogout_surface *surface, cairo_t *cairo,
+		int buffer_width, int buffer_height) {
+	struct waylogout_state *state = surface->state;
 
 	cairo_save(cairo);
 	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
@@ -38,19 +79,242 @@ void render_frame_background(struct waylogout_surface *surface) {
 			state->args.mode, buffer_width, buffer_height);
 	}
 	cairo_restore(cairo);
-	cairo_identity_matrix(cairo);
+}
+
+// The size of the background buffers. With --render-scale, a screenshot
+// that went through the effects is drawn at that fraction of the output's
+// resolution, and the viewport scales it back up.
+static void background_buffer_size(struct waylogout_surface *surface,
+		int *buffer_width, int *buffer_height) {
+	*buffer_width = surface->width * surface->scale;
+	*buffer_height = surface->height * surface->scale;
+	if (surface->image_reduced && *buffer_width > 0 && *buffer_height > 0) {
+		double fraction = surface->state->args.render_scale;
+		*buffer_width = *buffer_width * fraction > 1 ? *buffer_width * fraction : 1;
+		*buffer_height = *buffer_height * fraction > 1 ? *buffer_height * fraction : 1;
+	}
+}
+
+// Attaches a background buffer, which covers the whole surface
+static void background_attach(struct waylogout_surface *surface,
+		struct wl_buffer *buffer) {
+	if (surface->image_reduced) {
+		if (!surface->viewport) {
+			surface->viewport = wp_viewporter_get_viewport(
+					surface->state->viewporter, surface->surface);
+		}
+		wp_viewport_set_destination(surface->viewport,
+				surface->width, surface->height);
+		wl_surface_set_buffer_scale(surface->surface, 1);
+	} else {
+		if (surface->viewport) {
+			wp_viewport_set_destination(surface->viewport, -1, -1);
+		}
+		wl_surface_set_buffer_scale(surface->surface, surface->scale);
+	}
+	wl_surface_attach(surface->surface, buffer, 0, 0);
+	wl_surface_damage_buffer(surface->surface, 0, 0, INT32_MAX, INT32_MAX);
+	wl_surface_commit(surface->surface);
+}
+
+uint32_t *render_background_pixels(struct waylogout_surface *surface) {
+	int buffer_width, buffer_height;
+	background_buffer_size(surface, &buffer_width, &buffer_height);
+	if (buffer_width == 0 || buffer_height == 0) {
+		return NULL;
+	}
+
+	// The same layout as the pool buffers: ARGB32, without padding
+	uint32_t *pixels = malloc((size_t)buffer_width * buffer_height * 4);
+	if (pixels == NULL) {
+		return NULL;
+	}
+	cairo_surface_t *target = cairo_image_surface_create_for_data(
+			(unsigned char *)pixels, CAIRO_FORMAT_ARGB32,
+			buffer_width, buffer_height, buffer_width * 4);
+	cairo_t *cairo = cairo_create(target);
+	paint_background(surface, cairo, buffer_width, buffer_height);
+	cairo_destroy(cairo);
+	cairo_surface_flush(target);
+	cairo_surface_destroy(target);
+	return pixels;
+}
+
+// Whether the cached background is still what would be drawn. The pool
+// bumps a buffer's last_used whenever it hands the buffer out again, so a
+// changed last_used means the pixels have been drawn over.
+static bool background_is_cached(struct waylogout_surface *surface,
+		int buffer_width, int buffer_height) {
+	struct pool_buffer *buffer = surface->background.buffer;
+	return buffer != NULL &&
+		buffer->last_used == surface->background.last_used &&
+		surface->background.width == buffer_width &&
+		surface->background.height == buffer_height &&
+		surface->background.scale == surface->scale &&
+		surface->background.mode == surface->state->args.mode &&
+		surface->background.image == surface->image;
+}
+
+// Remembers the buffer that was just attached as the finished background
+static void background_cache_store(struct waylogout_surface *surface,
+		struct pool_buffer *buffer) {
+	surface->background.buffer = buffer;
+	surface->background.last_used = buffer->last_used;
+	surface->background.width = buffer->width;
+	surface->background.height = buffer->height;
+	surface->background.scale = surface->scale;
+	surface->background.mode = surface->state->args.mode;
+	surface->background.image = surface->image;
+	surface->background.attached = true;
+}
+
+// Whether the compositor can do the fade, by multiplying the surface's alpha.
+// That only covers fading in from transparent: cross-fades go through fade.c.
+static bool fade_by_alpha(struct waylogout_surface *surface) {
+#if HAVE_ALPHA_MODIFIER
+	return surface->state->alpha_modifier && !surface->fade.from_buffer;
+#else
+	(void)surface;
+	return false;
+#endif
+}
+
+static void set_surface_alpha(struct waylogout_surface *surface, float alpha) {
+#if HAVE_ALPHA_MODIFIER
+	if (!surface->alpha_modifier) {
+		surface->alpha_modifier = wp_alpha_modifier_v1_get_surface(
+				surface->state->alpha_modifier, surface->surface);
+	}
+	alpha = alpha < 0 ? 0 : alpha > 1 ? 1 : alpha;
+	wp_alpha_modifier_surface_v1_set_multiplier(surface->alpha_modifier,
+			(uint32_t)(alpha * (double)UINT32_MAX));
+#else
+	(void)surface;
+	(void)alpha;
+#endif
+}
+
+#if HAVE_SINGLE_PIXEL_BUFFER
+// Single pixel buffers take premultiplied channels over the full 32 bits
+static uint32_t solid_channel(uint32_t color, int shift, double alpha) {
+	return (uint32_t)(((color >> shift) & 0xff) / 255.0 * alpha * UINT32_MAX);
+}
+#endif
+
+// Shows the background as a single pixel, if it's a plain colour and the
+// compositor can scale buffers. Returns false to fall back to shm.
+static bool render_solid_background(struct waylogout_surface *surface) {
+#if HAVE_SINGLE_PIXEL_BUFFER
+	struct waylogout_state *state = surface->state;
+	if (!state->single_pixel_buffer_manager || !state->viewporter) {
+		return false;
+	}
+	if (surface->image && state->args.mode != BACKGROUND_MODE_SOLID_COLOR) {
+		return false;
+	}
+	// A fade draws every step into an shm buffer, unless the compositor
+	// does it
+	if (!fade_is_complete(&surface->fade) && !fade_by_alpha(surface)) {
+		return false;
+	}
+
+	if (surface->solid.width == surface->width &&
+			surface->solid.height == surface->height) {
+		return true; // already on screen
+	}
 
-	wl_surface_set_buffer_scale(surface->surface, surface->scale);
-	wl_surface_attach(surface->surface, surface->current_buffer->buffer, 0, 0);
+	if (!surface->solid.buffer) {
+		uint32_t color = state->args.colors.background;
+		double alpha = (color & 0xff) / 255.0;
+		surface->solid.buffer =
+			wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(
+				state->single_pixel_buffer_manager,
+				solid_channel(color, 24, alpha),
+				solid_channel(color, 16, alpha),
+				solid_channel(color, 8, alpha),
+				solid_channel(color, 0, 1.0));
+	}
+	if (!surface->viewport) {
+		surface->viewport = wp_viewporter_get_viewport(
+				state->viewporter, surface->surface);
+	}
+
+	surface->current_buffer = NULL;
+	surface->background.attached = false;
+	surface->solid.width = surface->width;
+	surface->solid.height = surface->height;
+
+	wp_viewport_set_destination(surface->viewport,
+			surface->width, surface->height);
+	wl_surface_set_buffer_scale(surface->surface, 1);
+	wl_surface_attach(surface->surface, surface->solid.buffer, 0, 0);
 	wl_surface_damage_buffer(surface->surface, 0, 0, INT32_MAX, INT32_MAX);
 	wl_surface_commit(surface->surface);
+	return true;
+#else
+	return false;
+#endif
+}
+
+void render_frame_background(struct waylogout_surface *surface) {
+	struct waylogout_state *state = surface->state;
+
+	int buffer_width, buffer_height;
+	background_buffer_size(surface, &buffer_width, &buffer_height);
+	if (buffer_width == 0 || buffer_height == 0) {
+		return; // not yet configured
+	}
+
+	// Goes in with the commit that attaches the background, so that it
+	// never shows at full alpha
+	if (!fade_is_complete(&surface->fade) && fade_by_alpha(surface)) {
+		set_surface_alpha(surface, fade_alpha(&surface->fade));
+	}
+
+	if (render_solid_background(surface)) {
+		return;
+	}
+	surface->solid.width = surface->solid.height = 0;
+
+	if (background_is_cached(surface, buffer_width, buffer_height)) {
+		surface->current_buffer = surface->background.buffer;
+		if (surface->background.attached) {
+			return;
+		}
+
+		// The compositor gets it back, so the pool mustn't hand it out
+		surface->current_buffer->busy = true;
+		surface->background.attached = true;
+		background_attach(surface, surface->current_buffer->buffer);
+		return;
+	}
+
+	surface->current_buffer = get_next_buffer(state->shm_pool,
+			&surface->buffers, buffer_width, buffer_height);
+	if (surface->current_buffer == NULL) {
+		return;
+	}
+
+	cairo_t *cairo = surface->current_buffer->cairo;
+	cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
+
+	paint_background(surface, cairo, buffer_width, buffer_height);
+	cairo_identity_matrix(cairo);
+
+	background_attach(surface, surface->current_buffer->buffer);
+
+	if (fade_is_complete(&surface->fade) || fade_by_alpha(surface)) {
+		background_cache_store(surface, surface->current_buffer);
+	} else {
+		surface->background.buffer = NULL;
+	}
 }
 
 void render_background_fade(struct waylogout_surface *surface, uint32_t time) {
 	struct waylogout_state *state = surface->state;
 
-	int buffer_width = surface->width * surface->scale;
-	int buffer_height = surface->height * surface->scale;
+	int buffer_width, buffer_height;
+	background_buffer_size(surface, &buffer_width, &buffer_height);
 	if (buffer_width == 0 || buffer_height == 0) {
 		return; // not yet configured
 	}
@@ -59,18 +323,35 @@ void render_background_fade(struct waylogout_surface *surface, uint32_t time) {
 		return;
 	}
 
-	surface->current_buffer = get_next_buffer(state->shm,
-			surface->buffers, buffer_width, buffer_height);
+	// The finished background is already attached: only its alpha changes
+	if (fade_by_alpha(surface)) {
+		set_surface_alpha(surface, fade_advance(&surface->fade, time));
+		wl_surface_commit(surface->surface);
+		return;
+	}
+
+	// The fade couldn't start for want of a buffer: start it now
+	if (!surface->fade.original_buffer) {
+		render_frame_background(surface);
+		render_background_fade_prepare(surface, surface->current_buffer);
+		return;
+	}
+
+	surface->current_buffer = get_next_buffer(state->shm_pool,
+			&surface->buffers, buffer_width, buffer_height);
 	if (surface->current_buffer == NULL) {
 		return;
 	}
 
 	fade_update(&surface->fade, surface->current_buffer, time);
+	background_attach(surface, surface->current_buffer->buffer);
 
-	wl_surface_set_buffer_scale(surface->surface, surface->scale);
-	wl_surface_attach(surface->surface, surface->current_buffer->buffer, 0, 0);
-	wl_surface_damage(surface->surface, 0, 0, surface->width, surface->height);
-	wl_surface_commit(surface->surface);
+	// The last step of the fade leaves the finished background behind
+	if (fade_is_complete(&surface->fade)) {
+		background_cache_store(surface, surface->current_buffer);
+	} else {
+		surface->background.attached = false;
+	}
 }
 
 void render_background_fade_prepare(struct waylogout_surface *surface, struct pool_buffer *buffer) {
@@ -78,12 +359,20 @@ void render_background_fade_prepare(struct waylogout_surface *surface, struct po
 		return;
 	}
 
-	fade_prepare(&surface->fade, buffer);
+	if (fade_by_alpha(surface)) {
+		return; // render_frame_background set the alpha
+	}
+	if (buffer == NULL) {
+		// No buffer was free. Whatever the fade was heading for is out
+		// of date, and render_background_fade starts it over.
+		free(surface->fade.original_buffer);
+		surface->fade.original_buffer = NULL;
+		return;
+	}
 
-	wl_surface_set_buffer_scale(surface->surface, surface->scale);
-	wl_surface_attach(surface->surface, surface->current_buffer->buffer, 0, 0);
-	wl_surface_damage(surface->surface, 0, 0, surface->width, surface->height);
-	wl_surface_commit(surface->surface);
+	fade_prepare(&surface->fade, buffer);
+	surface->background.buffer = NULL;
+	background_attach(surface, surface->current_buffer->buffer);
 }
 
 void render_frame(struct waylogout_action *action,
@@ -93,6 +382,14 @@ void render_frame(struct waylogout_action *action,
 
 	bool selected = (action == state->selected_action);
 
+	// Nothing to draw if the indicator looks as it did: at most, its other
+	// state goes back on screen
+	bool cached = sprite_is_cached(action, surface, selected);
+	if (cached) {
+		action->indicator_width = action->sprites[selected].buffer->width;
+		action->indicator_height = action->sprites[selected].buffer->height;
+	}
+
 	int buffer_width = action->indicator_width;
 	int buffer_height = action->indicator_height;
 	int new_width = fr_common.indicator_diameter;
@@ -115,9 +412,20 @@ void render_frame(struct waylogout_action *action,
 
 	wl_subsurface_set_position(action->subsurface, subsurf_xcenter, subsurf_ycenter);
 
+	if (cached) {
+		struct pool_buffer *buffer = action->sprites[selected].buffer;
+		if (action->attached_sprite != buffer) {
+			// The compositor gets it back, so the pool mustn't hand it out
+			buffer->busy = true;
+			attach_sprite(action, surface, buffer);
+		}
+		wl_surface_commit(surface->surface);
+		return;
+	}
+
 	// TODO should each action get its own current_buffer pointer?
-	surface->current_buffer = get_next_buffer(state->shm,
-			action->indicator_buffers, buffer_width, buffer_height);
+	surface->current_buffer = get_next_buffer(state->shm_pool,
+			&action->indicator_buffers, buffer_width, buffer_height);
 	if (surface->current_buffer == NULL) {
 		return;
 	}
@@ -125,6 +433,7 @@ void render_frame(struct waylogout_action *action,
 	// Hide subsurface until we want it visible
 	wl_surface_attach(action->child_surface, NULL, 0, 0);
 	wl_surface_commit(action->child_surface);
+	action->attached_sprite = NULL;
 
 	cairo_t *cairo = surface->current_buffer->cairo;
 	cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
@@ -234,17 +543,19 @@ void render_frame(struct waylogout_action *action,
 	new_width += surface->scale - (new_width % surface->scale);
 
 	if (buffer_width != new_width || buffer_height != new_height) {
-		destroy_buffer(surface->current_buffer);
+		put_back_buffer(surface->current_buffer);
 		action->indicator_width = new_width;
 		action->indicator_height = new_height;
 		render_frame(action, surface, fr_common);
 		return;
 	}
 
-	wl_surface_set_buffer_scale(action->child_surface, surface->scale);
-	wl_surface_attach(action->child_surface, surface->current_buffer->buffer, 0, 0);
-	wl_surface_damage_buffer(action->child_surface, 0, 0, INT32_MAX, INT32_MAX);
-	wl_surface_commit(action->child_surface);
+	attach_sprite(action, surface, surface->current_buffer);
+
+	struct waylogout_sprite *sprite = &action->sprites[selected];
+	*sprite = sprite_key(surface, selected);
+	sprite->buffer = surface->current_buffer;
+	sprite->last_used = surface->current_buffer->last_used;
 
 	wl_surface_commit(surface->surface);
 
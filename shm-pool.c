@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "log.h"
+#include "shm-pool.h"
+
+// Every slab reserves this much address space up front, so that it can grow
+// in place; the blocks in it never move.
+#define SHM_SLAB_RESERVE ((size_t)512 * 1024 * 1024)
+#define SHM_SLAB_MIN ((size_t)4 * 1024 * 1024)
+
+// A free range of a slab
+struct shm_range {
+	size_t offset, size;
+	struct shm_range *next;
+};
+
+struct shm_slab {
+	struct shm_pool *pool;
+	int fd;
+	struct wl_shm_pool *wl_pool;
+	uint8_t *base;
+	size_t size; // how much of the reserved space is in use
+	struct shm_range *free; // sorted by offset
+	struct shm_slab *next;
+};
+
+// Pages for the prefault thread to fault in
+struct shm_prefault {
+	uint8_t *data;
+	size_t size;
+	struct shm_prefault *next;
+};
+
+struct shm_pool {
+	struct wl_shm *shm;
+	size_t page_size;
+
+	pthread_mutex_t lock;
+	struct shm_slab *slabs;
+
+	pthread_mutex_t prefault_lock;
+	pthread_cond_t prefault_cond;
+	struct shm_prefault *prefault_queue;
+	bool stopping;
+	bool has_prefault_thread;
+	pthread_t prefault_thread;
+};
+
+static void prefault(uint8_t *data, size_t size, size_t page_size) {
+#ifdef MADV_POPULATE_WRITE
+	if (madvise(data, size, MADV_POPULATE_WRITE) == 0) {
+		return;
+	}
+#endif
+	// Adding zero leaves the contents alone, even if a block in the range
+	// is being drawn to at the same time
+	for (size_t offset = 0; offset < size; offset += page_size) {
+		__atomic_fetch_add(data + offset, 0, __ATOMIC_RELAXED);
+	}
+}
+
+static void *prefault_thread(void *data) {
+	struct shm_pool *pool = data;
+
+	pthread_mutex_lock(&pool->prefault_lock);
+	while (true) {
+		struct shm_prefault *job = pool->prefault_queue;
+		if (job == NULL) {
+			if (pool->stopping) {
+				break;
+			}
+			pthread_cond_wait(&pool->prefault_cond, &pool->prefault_lock);
+			continue;
+		}
+		pool->prefault_queue = job->next;
+
+		pthread_mutex_unlock(&pool->prefault_lock);
+		prefault(job->data, job->size, pool->page_size);
+		free(job);
+		pthread_mutex_lock(&pool->prefault_lock);
+	}
+	pthread_mutex_unlock(&pool->prefault_lock);
+	return NULL;
+}
+
+static void prefault_queue(struct shm_pool *pool, uint8_t *data, size_t size) {
+	if (!pool->has_prefault_thread) {
+		return;
+	}
+
+	struct shm_prefault *job = calloc(1, sizeof(*job));
+	job->data = data;
+	job->size = size;
+
+	pthread_mutex_lock(&pool->prefault_lock);
+	struct shm_prefault **tail = &pool->prefault_queue;
+	while (*tail) {
+		tail = &(*tail)->next;
+	}
+	*tail = job;
+	pthread_cond_signal(&pool->prefault_cond);
+	pthread_mutex_unlock(&pool->prefault_lock);
+}
+
+// Takes the first free range with room for 'size' bytes
+static bool range_take(struct shm_slab *slab, size_t size, size_t *offset) {
+	for (struct shm_range **iter = &slab->free; *iter; iter = &(*iter)->next) {
+		struct shm_range *range = *iter;
+		if (range->size < size) {
+			continue;
+		}
+
+		*offset = range->offset;
+		range->offset += size;
+		range->size -= size;
+		if (range->size == 0) {
+			*iter = range->next;
+			free(range);
+		}
+		return true;
+	}
+	return false;
+}
+
+// Gives a range back, merging it with its neighbours
+static void range_give(struct shm_slab *slab, size_t offset, size_t size) {
+	struct shm_range **iter = &slab->free;
+	struct shm_range *prev = NULL;
+	while (*iter && (*iter)->offset < offset) {
+		prev = *iter;
+		iter = &(*iter)->next;
+	}
+
+	struct shm_range *next = *iter;
+	if (prev && prev->offset + prev->size == offset) {
+		prev->size += size;
+		if (next && prev->offset + prev->size == next->offset) {
+			prev->size += next->size;
+			prev->next = next->next;
+			free(next);
+		}
+	} else if (next && offset + size == next->offset) {
+		next->offset = offset;
+		next->size += size;
+	} else {
+		struct shm_range *range = calloc(1, sizeof(*range));
+		range->offset = offset;
+		range->size = size;
+		range->next = next;
+		*iter = range;
+	}
+}
+
+// The free space at the end of the slab, which growing the slab adds to
+static size_t slab_tail_free(struct shm_slab *slab) {
+	struct shm_range *range = slab->free;
+	while (range && range->next) {
+		range = range->next;
+	}
+	if (range && range->offset + range->size == slab->size) {
+		return range->size;
+	}
+	return 0;
+}
+
+static bool slab_grow(struct shm_slab *slab, size_t size) {
+	int ret;
+	while ((ret = ftruncate(slab->fd, size)) == -1 && errno == EINTR) {
+		// No-op
+	}
+	if (ret < 0) {
+		waylogout_log_errno(LOG_ERROR, "Failed to grow shm slab to %zu bytes", size);
+		return false;
+	}
+
+	void *data = mmap(slab->base + slab->size, size - slab->size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, slab->fd, slab->size);
+	if (data == MAP_FAILED) {
+		waylogout_log_errno(LOG_ERROR, "Failed to map shm slab");
+		return false;
+	}
+
+	if (slab->wl_pool) {
+		wl_shm_pool_resize(slab->wl_pool, size);
+	}
+	waylogout_log(LOG_DEBUG, "Grew shm slab from %zu to %zu bytes", slab->size, size);
+
+	size_t old_size = slab->size;
+	slab->size = size;
+	range_give(slab, old_size, size - old_size);
+	prefault_queue(slab->pool, slab->base + old_size, size - old_size);
+	return true;
+}
+
+static void slab_destroy(struct shm_slab *slab) {
+	if (slab->wl_pool) {
+		wl_shm_pool_destroy(slab->wl_pool);
+	}
+	munmap(slab->base, SHM_SLAB_RESERVE);
+	close(slab->fd);
+
+	struct shm_range *range = slab->free;
+	while (range) {
+		struct shm_range *next = range->next;
+		free(range);
+		range = next;
+	}
+	free(slab);
+}
+
+static struct shm_slab *slab_create(struct shm_pool *pool, size_t size) {
+	struct shm_slab *slab = calloc(1, sizeof(*slab));
+	slab->pool = pool;
+
+	slab->fd = memfd_create("waylogout-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (slab->fd < 0) {
+		waylogout_log_errno(LOG_ERROR, "memfd_create failed");
+		free(slab);
+		return NULL;
+	}
+
+	slab->base = mmap(NULL, SHM_SLAB_RESERVE, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (slab->base == MAP_FAILED) {
+		waylogout_log_errno(LOG_ERROR, "Failed to reserve space for shm slab");
+		close(slab->fd);
+		free(slab);
+		return NULL;
+	}
+
+	if (!slab_grow(slab, size)) {
+		slab_destroy(slab);
+		return NULL;
+	}
+
+	// Promise the compositor that the slab never shrinks under it
+	fcntl(slab->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
+
+	slab->wl_pool = wl_shm_create_pool(pool->shm, slab->fd, size);
+	return slab;
+}
+
+struct shm_pool *shm_pool_create(struct wl_shm *shm) {
+	struct shm_pool *pool = calloc(1, sizeof(struct shm_pool));
+	if (!pool) {
+		waylogout_log(LOG_ERROR, "Unable to allocate memory for shm pool");
+		return NULL;
+	}
+
+	pool->shm = shm;
+	pool->page_size = sysconf(_SC_PAGESIZE);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_mutex_init(&pool->prefault_lock, NULL);
+	pthread_cond_init(&pool->prefault_cond, NULL);
+
+	int err = pthread_create(&pool->prefault_thread, NULL, prefault_thread, pool);
+	if (err != 0) {
+		waylogout_log(LOG_ERROR, "Unable to create prefault thread: %s", strerror(err));
+	} else {
+		pool->has_prefault_thread = true;
+	}
+	return pool;
+}
+
+void shm_pool_destroy(struct shm_pool *pool) {
+	if (pool->has_prefault_thread) {
+		pthread_mutex_lock(&pool->prefault_lock);
+		pool->stopping = true;
+		pthread_cond_signal(&pool->prefault_cond);
+		pthread_mutex_unlock(&pool->prefault_lock);
+		pthread_join(pool->prefault_thread, NULL);
+	}
+
+	struct shm_slab *slab = pool->slabs;
+	while (slab) {
+		struct shm_slab *next = slab->next;
+		slab_destroy(slab);
+		slab = next;
+	}
+
+	pthread_cond_destroy(&pool->prefault_cond);
+	pthread_mutex_destroy(&pool->prefault_lock);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+struct shm_block *shm_pool_alloc(struct shm_pool *pool, size_t size) {
+	size = (size + pool->page_size - 1) & ~(pool->page_size - 1);
+	if (size == 0 || size > SHM_SLAB_RESERVE) {
+		waylogout_log(LOG_ERROR, "Can't allocate an shm block of %zu bytes", size);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	struct shm_slab *slab;
+	size_t offset;
+
+	// A free range in some slab, or else some slab with room to grow, or
+	// else a new slab. Slabs at least double when they grow, so that they
+	// have room for the next few blocks.
+	for (slab = pool->slabs; slab; slab = slab->next) {
+		if (range_take(slab, size, &offset)) {
+			goto found;
+		}
+	}
+	for (slab = pool->slabs; slab; slab = slab->next) {
+		size_t needed = slab->size + size - slab_tail_free(slab);
+		if (needed > SHM_SLAB_RESERVE) {
+			continue;
+		}
+		size_t grown = slab->size * 2 > needed ? slab->size * 2 : needed;
+		grown = grown < SHM_SLAB_RESERVE ? grown : SHM_SLAB_RESERVE;
+		if (slab_grow(slab, grown) && range_take(slab, size, &offset)) {
+			goto found;
+		}
+	}
+
+	slab = slab_create(pool, size > SHM_SLAB_MIN ? size : SHM_SLAB_MIN);
+	if (slab == NULL || !range_take(slab, size, &offset)) {
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+
+found:
+	pthread_mutex_unlock(&pool->lock);
+
+	struct shm_block *block = calloc(1, sizeof(struct shm_block));
+	block->slab = slab;
+	block->offset = offset;
+	block->size = size;
+	block->data = slab->base + offset;
+	return block;
+}
+
+// Hands a free range's pages back to the kernel; the slab keeps its size, and
+// the range reads as zeroes until it is written again
+static void slab_release_pages(struct shm_slab *slab, size_t offset, size_t size) {
+	if (fallocate(slab->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				offset, size) == 0) {
+		return;
+	}
+	if (madvise(slab->base + offset, size, MADV_REMOVE) < 0) {
+		waylogout_log_errno(LOG_DEBUG, "Failed to release %zu bytes of "
+				"shm slab", size);
+	}
+}
+
+void shm_block_free(struct shm_block *block) {
+	struct shm_pool *pool = block->slab->pool;
+
+	// Before the range is given back, while nothing else can be using it
+	slab_release_pages(block->slab, block->offset, block->size);
+
+	pthread_mutex_lock(&pool->lock);
+	range_give(block->slab, block->offset, block->size);
+	pthread_mutex_unlock(&pool->lock);
+	free(block);
+}
+
+struct wl_buffer *shm_block_create_buffer(struct shm_block *block,
+		int32_t width, int32_t height, int32_t stride, uint32_t format) {
+	return wl_shm_pool_create_buffer(block->slab->wl_pool, block->offset,
+			width, height, stride, format);
+}
@@ -0,0 +1,207 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "log.h"
+#include "worker.h"
+
+#define WORKER_MAX_THREADS 8
+
+struct worker_job {
+	void (*run)(void *data);
+	void (*done)(void *data);
+	void *data;
+	struct worker_job *next;
+};
+
+struct worker_job_list {
+	struct worker_job *head, *tail;
+};
+
+struct worker_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct worker_job_list queued; // jobs waiting for a thread
+	struct worker_job_list finished; // jobs waiting for dispatch
+	bool stopping;
+	int pending; // jobs submitted and not yet dispatched
+
+	// A byte is written to the pipe when the finished list becomes non-empty
+	int fds[2];
+
+	pthread_t *threads;
+	int thread_count;
+};
+
+static void job_list_push(struct worker_job_list *list, struct worker_job *job) {
+	job->next = NULL;
+	if (list->tail) {
+		list->tail->next = job;
+	} else {
+		list->head = job;
+	}
+	list->tail = job;
+}
+
+static struct worker_job *job_list_pop(struct worker_job_list *list) {
+	struct worker_job *job = list->head;
+	if (job) {
+		list->head = job->next;
+		if (list->head == NULL) {
+			list->tail = NULL;
+		}
+	}
+	return job;
+}
+
+static void *worker_thread(void *data) {
+	struct worker_pool *pool = data;
+
+	pthread_mutex_lock(&pool->lock);
+	while (true) {
+		struct worker_job *job = job_list_pop(&pool->queued);
+		if (job == NULL) {
+			if (pool->stopping) {
+				break;
+			}
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&pool->lock);
+		job->run(job->data);
+		pthread_mutex_lock(&pool->lock);
+
+		bool wake = pool->finished.head == NULL;
+		job_list_push(&pool->finished, job);
+		if (wake) {
+			char byte = 0;
+			while (write(pool->fds[1], &byte, 1) < 0 && errno == EINTR) {
+				// No-op
+			}
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+struct worker_pool *worker_pool_create(int threads) {
+	if (threads <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus < 1 ? 1 : cpus > WORKER_MAX_THREADS ? WORKER_MAX_THREADS : cpus;
+	}
+
+	struct worker_pool *pool = calloc(1, sizeof(struct worker_pool));
+	if (!pool) {
+		waylogout_log(LOG_ERROR, "Unable to allocate memory for worker pool");
+		return NULL;
+	}
+
+	if (pipe(pool->fds) < 0) {
+		waylogout_log_errno(LOG_ERROR, "Unable to create worker pool pipe");
+		free(pool);
+		return NULL;
+	}
+	for (int i = 0; i < 2; ++i) {
+		fcntl(pool->fds[i], F_SETFD, FD_CLOEXEC);
+		fcntl(pool->fds[i], F_SETFL, O_NONBLOCK);
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	pool->threads = calloc(threads, sizeof(pthread_t));
+	for (int i = 0; i < threads; ++i) {
+		int err = pthread_create(&pool->threads[i], NULL, worker_thread, pool);
+		if (err != 0) {
+			waylogout_log(LOG_ERROR, "Unable to create worker thread: %s",
+					strerror(err));
+			break;
+		}
+		pool->thread_count += 1;
+	}
+
+	if (pool->thread_count == 0) {
+		worker_pool_destroy(pool);
+		return NULL;
+	}
+	waylogout_log(LOG_DEBUG, "Started %d worker threads", pool->thread_count);
+	return pool;
+}
+
+void worker_pool_destroy(struct worker_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->thread_count; ++i) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	struct worker_job *job;
+	while ((job = job_list_pop(&pool->finished))) {
+		free(job);
+	}
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	close(pool->fds[0]);
+	close(pool->fds[1]);
+	free(pool->threads);
+	free(pool);
+}
+
+void worker_pool_submit(struct worker_pool *pool,
+		void (*run)(void *data), void (*done)(void *data), void *data) {
+	struct worker_job *job = calloc(1, sizeof(struct worker_job));
+	job->run = run;
+	job->done = done;
+	job->data = data;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->pending += 1;
+	job_list_push(&pool->queued, job);
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int worker_pool_get_fd(struct worker_pool *pool) {
+	return pool->fds[0];
+}
+
+void worker_pool_dispatch(struct worker_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	char buf[64];
+	while (read(pool->fds[0], buf, sizeof(buf)) > 0) {
+		// Drain the pipe
+	}
+	struct worker_job_list finished = pool->finished;
+	pool->finished.head = pool->finished.tail = NULL;
+	pthread_mutex_unlock(&pool->lock);
+
+	struct worker_job *job;
+	int count = 0;
+	while ((job = job_list_pop(&finished))) {
+		if (job->done) {
+			job->done(job->data);
+		}
+		free(job);
+		count += 1;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->pending -= count;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+bool worker_pool_is_idle(struct worker_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	bool idle = pool->pending == 0;
+	pthread_mutex_unlock(&pool->lock);
+	return idle;
+}